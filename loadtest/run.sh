@@ -0,0 +1,228 @@
+#!/usr/bin/env bash
+#
+# End-to-end load test: builds nginx with this module, serves a generated
+# image tree and drives it with wrk.  Results go to results/<timestamp>.csv,
+# one line per scenario:
+#
+#   scenario,requests_per_sec,p99_ms,worker_cpu_sec,errors
+#
+# Scenarios:
+#   hit       every request is a cache hit (tree is warmed first)
+#   miss      every request converts a source that was never requested
+#   hotkey    all clients request the same, initially uncached image
+#   pressure  working set larger than webp_max_cache_size
+#   reload    hit traffic with "nginx -s reload" half way through
+#
+# Usage:
+#   NGINX_SRC=/path/to/nginx-1.x.y ./run.sh [scenario ...]
+#
+# Environment:
+#   NGINX_SRC     nginx source tree (required unless NGINX_BIN is set)
+#   NGINX_BIN     prebuilt nginx with the module, skips the build
+#   DURATION      seconds per scenario (default 30)
+#   CONNECTIONS   wrk connections (default 256)
+#   WRK_THREADS   wrk threads (default 4)
+#   WORKERS       nginx worker_processes (default auto)
+#   THREADS       thread pool size (default 8)
+#   IMAGES        images in the generated tree (default 2000)
+#   IMAGE_SIZE    generated image geometry (default 1280x720)
+#   PORT          listen port (default 8089)
+
+set -euo pipefail
+
+here=$(cd "$(dirname "$0")" && pwd)
+module=$(cd "$here/.." && pwd)
+work=${WORK_DIR:-$here/work}
+
+DURATION=${DURATION:-30}
+CONNECTIONS=${CONNECTIONS:-256}
+WRK_THREADS=${WRK_THREADS:-4}
+WORKERS=${WORKERS:-auto}
+THREADS=${THREADS:-8}
+IMAGES=${IMAGES:-2000}
+IMAGE_SIZE=${IMAGE_SIZE:-1280x720}
+PORT=${PORT:-8089}
+
+scenarios=${*:-hit miss hotkey pressure reload}
+
+die() {
+    echo "run.sh: $*" >&2
+    exit 1
+}
+
+command -v wrk >/dev/null || die "wrk not found"
+command -v convert >/dev/null || die "ImageMagick 'convert' not found"
+
+build_nginx() {
+    if [ -n "${NGINX_BIN:-}" ]; then
+        return
+    fi
+
+    [ -n "${NGINX_SRC:-}" ] || die "set NGINX_SRC or NGINX_BIN"
+
+    if [ ! -x "$work/build/sbin/nginx" ] || [ "$module" -nt "$work/build/sbin/nginx" ]; then
+        (cd "$NGINX_SRC" \
+            && ./configure --prefix="$work/build" --with-threads \
+                           --add-module="$module" >/dev/null \
+            && make -j"$(nproc)" >/dev/null \
+            && make install >/dev/null)
+    fi
+
+    NGINX_BIN=$work/build/sbin/nginx
+}
+
+generate_tree() {
+    local dir=$work/root/images
+
+    if [ -f "$dir/.complete-$IMAGES-$IMAGE_SIZE" ]; then
+        return
+    fi
+
+    rm -rf "$dir"
+    mkdir -p "$dir"
+
+    convert -seed 1 -size "$IMAGE_SIZE" plasma:fractal "$dir/seed.png"
+
+    # distinct bytes per image so conversions are not trivially identical
+    for i in $(seq 0 $((IMAGES - 1))); do
+        convert "$dir/seed.png" -roll "+$i+$((i * 7))" -quality 85 "$dir/img-$i.jpg"
+    done
+
+    touch "$dir/.complete-$IMAGES-$IMAGE_SIZE"
+}
+
+start_nginx() {
+    local max_cache_size=$1
+    local prefix=$work/prefix
+
+    stop_nginx
+    rm -rf "$prefix"
+    mkdir -p "$prefix/logs" "$prefix/cache"
+
+    sed -e "s|@WORKERS@|$WORKERS|g" \
+        -e "s|@THREADS@|$THREADS|g" \
+        -e "s|@PREFIX@|$prefix|g" \
+        -e "s|@PORT@|$PORT|g" \
+        -e "s|@ROOT@|$work/root|g" \
+        -e "s|@MAX_CACHE_SIZE@|$max_cache_size|g" \
+        "$here/nginx.conf.in" > "$prefix/nginx.conf"
+
+    "$NGINX_BIN" -p "$prefix" -c "$prefix/nginx.conf"
+
+    for _ in $(seq 50); do
+        curl -s -o /dev/null "http://127.0.0.1:$PORT/" && return
+        sleep 0.1
+    done
+
+    die "nginx did not come up, see $prefix/logs/error.log"
+}
+
+stop_nginx() {
+    local pidfile=$work/prefix/logs/nginx.pid
+
+    if [ -f "$pidfile" ]; then
+        kill -QUIT "$(cat "$pidfile")" 2>/dev/null || true
+        sleep 1
+    fi
+}
+
+# user+system clock ticks of all current worker processes
+worker_ticks() {
+    local master total=0 pid
+
+    master=$(cat "$work/prefix/logs/nginx.pid")
+
+    for pid in $(pgrep -P "$master"); do
+        total=$((total + $(awk '{ print $14 + $15 }' "/proc/$pid/stat" 2>/dev/null || echo 0)))
+    done
+
+    echo "$total"
+}
+
+warm() {
+    WEBP_IMAGES=$1 WEBP_EXT=jpg WEBP_THREADS=$WRK_THREADS \
+        wrk -t"$WRK_THREADS" -c"$WRK_THREADS" -d"$2" -s "$here/urls.lua" \
+            "http://127.0.0.1:$PORT" >/dev/null
+}
+
+# run_wrk <name> <duration> [wrk args...]; appends one CSV line
+run_wrk() {
+    local name=$1 duration=$2 out before after hz rps p99 errors
+    shift 2
+
+    hz=$(getconf CLK_TCK)
+    before=$(worker_ticks)
+
+    out=$(wrk -t"$WRK_THREADS" -c"$CONNECTIONS" -d"$duration" --latency "$@")
+
+    after=$(worker_ticks)
+
+    rps=$(echo "$out" | awk '/Requests\/sec/ { print $2 }')
+    p99=$(echo "$out" | awk '$1 == "99%" {
+            v = $2; u = v; sub(/[0-9.]+/, "", u); sub(/[a-z]+$/, "", v);
+            if (u == "us") v /= 1000; else if (u == "s") v *= 1000;
+            print v }')
+    errors=$(echo "$out" | awk '/Non-2xx|Socket errors/ { n += $NF } END { print n + 0 }')
+
+    echo "$name,$rps,$p99,$(awk -v t=$((after - before)) -v hz="$hz" 'BEGIN { printf "%.2f", t / hz }'),$errors" \
+        | tee -a "$results"
+}
+
+scenario_hit() {
+    start_nginx 10g
+    warm "$IMAGES" 60s
+    WEBP_IMAGES=$IMAGES WEBP_EXT=jpg WEBP_THREADS=$WRK_THREADS \
+        run_wrk hit "$DURATION"s -s "$here/urls.lua" "http://127.0.0.1:$PORT"
+}
+
+scenario_miss() {
+    # a fresh cache and a tree big enough that no source repeats in the run
+    start_nginx 10g
+    WEBP_IMAGES=$IMAGES WEBP_EXT=jpg WEBP_THREADS=$WRK_THREADS \
+        run_wrk miss "$DURATION"s -s "$here/urls.lua" "http://127.0.0.1:$PORT"
+}
+
+scenario_hotkey() {
+    start_nginx 10g
+    run_wrk hotkey "$DURATION"s -H "Accept: image/webp,*/*" \
+        "http://127.0.0.1:$PORT/images/img-0.jpg"
+}
+
+scenario_pressure() {
+    local each
+
+    # cache holds roughly a tenth of the converted tree
+    each=$(stat -c %s "$work/root/images/img-0.jpg")
+    start_nginx $((each * IMAGES / 10 / 2))
+    warm "$IMAGES" 30s
+    WEBP_IMAGES=$IMAGES WEBP_EXT=jpg WEBP_THREADS=$WRK_THREADS \
+        run_wrk pressure "$DURATION"s -s "$here/urls.lua" "http://127.0.0.1:$PORT"
+}
+
+scenario_reload() {
+    start_nginx 10g
+    warm "$IMAGES" 60s
+
+    (sleep $((DURATION / 2)) && "$NGINX_BIN" -p "$work/prefix" -c "$work/prefix/nginx.conf" -s reload) &
+
+    WEBP_IMAGES=$IMAGES WEBP_EXT=jpg WEBP_THREADS=$WRK_THREADS \
+        run_wrk reload "$DURATION"s -s "$here/urls.lua" "http://127.0.0.1:$PORT"
+    wait
+}
+
+mkdir -p "$work" "$here/results"
+results=$here/results/$(date +%Y%m%d-%H%M%S).csv
+echo "scenario,requests_per_sec,p99_ms,worker_cpu_sec,errors" > "$results"
+
+build_nginx
+generate_tree
+
+trap stop_nginx EXIT
+
+for s in $scenarios; do
+    type "scenario_$s" >/dev/null 2>&1 || die "unknown scenario \"$s\""
+    "scenario_$s"
+    curl -s "http://127.0.0.1:$PORT/webp_status" > "$here/results/$(basename "$results" .csv)-$s-status.json" || true
+done
+
+echo "results: $results"
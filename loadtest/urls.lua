@@ -0,0 +1,27 @@
+-- wrk script: walks /images/img-<n>.<ext> so that every request of a run
+-- addresses a different source.  Each wrk thread starts at its own offset
+-- and strides by the thread count, so threads never overlap.
+--
+--   WEBP_IMAGES   number of images in the tree
+--   WEBP_EXT      source extension (jpg, png)
+--   WEBP_THREADS  wrk -t value
+
+local images = tonumber(os.getenv("WEBP_IMAGES") or "1000")
+local ext = os.getenv("WEBP_EXT") or "jpg"
+local stride = tonumber(os.getenv("WEBP_THREADS") or "1")
+local counter = 0
+
+function setup(thread)
+    thread:set("offset", counter)
+    counter = counter + 1
+end
+
+function init(args)
+    n = offset
+end
+
+function request()
+    local path = string.format("/images/img-%d.%s", n % images, ext)
+    n = n + stride
+    return wrk.format("GET", path, { ["Accept"] = "image/webp,*/*" })
+end
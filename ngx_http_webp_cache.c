@@ -1,13 +1,23 @@
 #include "ngx_http_webp_module.h"
 
+static ngx_int_t ngx_http_webp_serve_sidecar(ngx_http_request_t *r, ngx_http_webp_loc_conf_t *conf,
+    ngx_http_webp_convert_ctx_t *ctx);
+static ngx_int_t ngx_http_webp_map_source(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx);
+static ngx_int_t ngx_http_webp_stat_file(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of);
+static ngx_int_t ngx_http_webp_check_loaded(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx,
+    ngx_open_file_info_t *of);
+static ngx_int_t ngx_http_webp_check_source(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx);
+static ngx_int_t ngx_http_webp_adopt_file(ngx_http_request_t *r, ngx_http_webp_loc_conf_t *conf,
+    ngx_http_webp_convert_ctx_t *ctx);
+
 ngx_int_t
 ngx_http_webp_handler(ngx_http_request_t *r)
 {
     ngx_http_webp_loc_conf_t *conf;
-    ngx_str_t src_path, dst_path, *uri;
-    u_char hash[SHA_DIGEST_LENGTH * 2 + 1];
-    ngx_str_t cache_key;
+    ngx_http_webp_convert_ctx_t *ctx;
+    ngx_http_webp_format_e format;
     ngx_uint_t quality;
+    ngx_int_t rc;
     ngx_str_t res;
 
     conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
@@ -16,15 +26,24 @@ ngx_http_webp_handler(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
-    uri = &r->uri;
-    if (!ngx_strstr(uri->data, ".jpg") && !ngx_strstr(uri->data, ".jpeg") && 
-        !ngx_strstr(uri->data, ".png") && !ngx_strstr(uri->data, ".avif") && 
-        !ngx_strstr(uri->data, ".jxl")) {
+    format = ngx_http_webp_codec_format((char *) r->uri.data, r->uri.len);
+    if (format == NGX_HTTP_WEBP_FORMAT_UNKNOWN) {
         return NGX_DECLINED;
     }
 
-    ngx_http_variable_value_t *accept = ngx_http_get_variable(r, &ngx_http_accept_header_key, ngx_hash_key(ngx_http_accept_header_key.data, ngx_http_accept_header_key.len));
-    if (accept == NULL || ngx_strstr(accept->data, "image/webp") == NULL) {
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_webp_convert_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->format = format;
+    ctx->request = r;
+    ctx->stats = ngx_http_webp_stats(r);
+    ctx->cache_status = NGX_HTTP_WEBP_CACHE_BYPASS;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_webp_module);
+
+    if (!ngx_http_webp_accepts_webp(r)) {
         NGX_HTTP_WEBP_LOG(NGX_LOG_DEBUG, r->connection->log, 0,
                           "Client does not support WebP");
         return NGX_DECLINED;
@@ -40,218 +59,1317 @@ ngx_http_webp_handler(ngx_http_request_t *r)
         }
     }
 
-    if (conf->quality_if) {
-        if (ngx_http_complex_value(r, conf->quality_if, &res) != NGX_OK) {
-            return NGX_ERROR;
+    if (conf->sidecar != NULL) {
+        rc = ngx_http_webp_serve_sidecar(r, conf, ctx);
+        if (rc != NGX_DECLINED) {
+            return rc;
         }
+    }
 
-        quality = ngx_atoi(res.data, res.len);
-        if (quality == (ngx_uint_t) NGX_ERROR || quality > 100) {
-            NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, r->connection->log, 0,
-                              "Invalid quality value: \"%V\"", &res);
-            return NGX_ERROR;
+    if (ngx_http_webp_quality(r, conf, &quality) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ctx->quality = quality;
+
+    if (ngx_http_webp_cache_key(r, &r->uri, quality, &ctx->cache_key, &ctx->dst_path) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_webp_lookup_cache(r, ctx);
+
+    /* the index only vouches for the source an entry was made from */
+
+    if (rc == NGX_OK || rc == NGX_DONE) {
+        switch (ngx_http_webp_check_source(r, ctx)) {
+        case NGX_OK:
+            break;
+        case NGX_DECLINED:
+            ngx_http_webp_invalidate_cache(r, ctx);
+            rc = NGX_DECLINED;
+            break;
+        default:
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
-    } else {
-        quality = conf->quality;
     }
 
-    if (ngx_http_webp_limit_req(r) != NGX_OK) {
-        return NGX_HTTP_TOO_MANY_REQUESTS;
+    if (rc == NGX_DONE) {
+        /* a recent attempt showed this image should be served as is */
+        ngx_http_webp_stats_add(ctx->stats, negative_hits, 1);
+        return NGX_DECLINED;
     }
 
-    ngx_sha1_t sha1;
-    ngx_sha1_init(&sha1);
-    ngx_sha1_update(&sha1, r->unparsed_uri.data, r->unparsed_uri.len);
-    ngx_sha1_final(hash, &sha1);
+    if (rc == NGX_OK) {
+
+        /* revalidations are answered from the index alone */
+
+        rc = ngx_http_webp_not_modified(r, ctx);
+        if (rc != NGX_DECLINED) {
+            ngx_http_webp_stats_add(ctx->stats, hits, 1);
+            return rc;
+        }
+
+        if (ctx->segment) {
+            if (ngx_http_webp_segment_path(r, ctx) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            rc = ngx_http_webp_serve_file(r, &ctx->segment_path);
+
+        } else {
+            rc = ngx_http_webp_serve_file(r, &ctx->dst_path);
+        }
 
-    src_path = *uri;
-    dst_path.len = conf->cache_dir.len + sizeof(hash) + 5;
-    dst_path.data = ngx_pcalloc(r->pool, dst_path.len);
-    ngx_sprintf(dst_path.data, "%V/%s.webp", &conf->cache_dir, hash);
+        if (rc != NGX_HTTP_NOT_FOUND) {
+            ngx_http_webp_stats_add(ctx->stats, hits, 1);
+            return rc;
+        }
+
+        /* the file went away under the index, purged or cleaned up */
+
+        NGX_HTTP_WEBP_LOG(NGX_LOG_DEBUG, r->connection->log, 0,
+                          "Indexed WebP variant is missing: %V", &ctx->cache_key);
+
+        ngx_http_webp_invalidate_cache(r, ctx);
+    }
+
+    if (ngx_http_webp_map_source(r, ctx) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_webp_adopt_file(r, conf, ctx);
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    ngx_http_webp_stats_add(ctx->stats, misses, 1);
 
-    cache_key.data = hash;
-    cache_key.len = sizeof(hash) - 1;
+    /* only conversions are limited, hits and negative entries are cheap */
 
-    if (ngx_http_webp_lookup_cache(r, &cache_key, &dst_path) == NGX_OK) {
-        return ngx_http_webp_serve_file(r, &dst_path);
+    if (ngx_http_webp_limit_req(r) != NGX_OK) {
+        return NGX_HTTP_TOO_MANY_REQUESTS;
     }
 
     NGX_HTTP_WEBP_LOG(NGX_LOG_DEBUG, r->connection->log, 0,
-                      "Converting image to WebP: %V", &src_path);
+                      "Converting image to WebP: %V", &ctx->src_path);
 
-    ngx_int_t rc = ngx_http_webp_convert_image(r, &src_path, &dst_path);
+    rc = ngx_http_webp_convert_image(r, ctx);
     if (rc == NGX_ERROR) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    return ngx_http_webp_serve_file(r, &dst_path);
+    return rc;
 }
 
+/* webp_quality, or webp_quality_if when it is set */
 ngx_int_t
-ngx_http_webp_lookup_cache(ngx_http_request_t *r, ngx_str_t *cache_key, ngx_str_t *file_path)
+ngx_http_webp_quality(ngx_http_request_t *r, ngx_http_webp_loc_conf_t *conf, ngx_uint_t *quality)
 {
-    ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
-    ngx_http_webp_shm_ctx_t *ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)conf->cache_zone->shm.addr;
-    ngx_http_webp_cache_entry_t *entry;
-    uint32_t hash;
-    ngx_rbtree_node_t *node, *sentinel;
+    ngx_str_t res;
 
-    hash = ngx_crc32_long(cache_key->data, cache_key->len);
+    if (conf->quality_if == NULL) {
+        *quality = conf->quality;
+        return NGX_OK;
+    }
 
-    ngx_shmtx_lock(&shpool->mutex);
+    if (ngx_http_complex_value(r, conf->quality_if, &res) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    node = ctx->rbtree.root;
-    sentinel = ctx->rbtree.sentinel;
+    *quality = ngx_atoi(res.data, res.len);
+    if (*quality == (ngx_uint_t) NGX_ERROR || *quality > 100) {
+        NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, r->connection->log, 0,
+                          "Invalid quality value: \"%V\"", &res);
+        return NGX_ERROR;
+    }
 
-    while (node != sentinel) {
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+    return NGX_OK;
+}
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
+ngx_uint_t
+ngx_http_webp_accepts_webp(ngx_http_request_t *r)
+{
+    static ngx_str_t name = ngx_string("http_accept");
+    ngx_http_variable_value_t *accept;
+
+    accept = ngx_http_get_variable(r, &name, ngx_hash_key(name.data, name.len));
+
+    return accept != NULL && !accept->not_found
+           && ngx_strlcasestrn(accept->data, accept->data + accept->len, (u_char *) "image/webp", 10 - 1) != NULL;
+}
+
+static ngx_int_t
+ngx_http_webp_map_source(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
+{
+    size_t root;
+    u_char *last;
+
+    if (ctx->src_path.data != NULL) {
+        return NGX_OK;
+    }
+
+    last = ngx_http_map_uri_to_path(r, &ctx->src_path, &root, 0);
+    if (last == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->src_path.len = last - ctx->src_path.data;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_webp_stat_file(ngx_http_request_t *r, ngx_str_t *path, ngx_open_file_info_t *of)
+{
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(of, sizeof(ngx_open_file_info_t));
+
+    of->test_only = 1;
+    of->valid = clcf->open_file_cache_valid;
+    of->min_uses = clcf->open_file_cache_min_uses;
+    of->errors = clcf->open_file_cache_errors;
+    of->events = clcf->open_file_cache_events;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, path, of, r->pool) != NGX_OK
+        || !of->is_file)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * An entry of the cache loader only knows its variant file's mtime, which
+ * must not be older than the source.  The first hit that finds it fresh
+ * records the source's fingerprint, URI and quality, as adopt_file() does.
+ */
+static ngx_int_t
+ngx_http_webp_check_loaded(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx, ngx_open_file_info_t *of)
+{
+    ngx_http_webp_loc_conf_t *conf;
+
+    if (of->mtime > ctx->source_mtime) {
+        return NGX_DECLINED;
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+
+    ctx->image_size = (size_t) of->size;
+    ctx->source_mtime = of->mtime;
+    ctx->encoded_quality = (conf->target == NGX_HTTP_WEBP_TARGET_NONE) ? ctx->quality
+                                                                       : NGX_HTTP_WEBP_QUALITY_UNKNOWN;
+
+    if (ngx_http_webp_store_cache(r, ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "Failed to index WebP file: %V", &ctx->dst_path);
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Compares the source fingerprint lookup_cache() copied out of a hit or a
+ * negative entry with the file on disk, stat()ed through the open file
+ * cache as serve_sidecar() does.  Without open_file_cache that would be a
+ * stat() per hit, so only entries of the cache loader, which lack the
+ * fingerprint, are checked then; the others rely on expiry and purges.
+ * NGX_DECLINED means the source changed or is gone and the entry must not
+ * be used.
+ */
+static ngx_int_t
+ngx_http_webp_check_source(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
+{
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_open_file_info_t of;
+    ngx_uint_t loaded;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    loaded = (ctx->image_size == 0 && ctx->state == NGX_HTTP_WEBP_STATE_OK);
+
+    if (clcf->open_file_cache == NULL && !loaded) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_webp_map_source(r, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_webp_stat_file(r, &ctx->src_path, &of) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    if (loaded) {
+        return ngx_http_webp_check_loaded(r, ctx, &of);
+    }
+
+    if (of.mtime != ctx->source_mtime || (size_t) of.size != ctx->image_size) {
+        NGX_HTTP_WEBP_LOG(NGX_LOG_DEBUG, r->connection->log, 0,
+                          "Source changed since it was indexed: %V", &ctx->src_path);
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * An index miss may still find "<key>.webp" on disk, written before the zone
+ * was created or by ngx_webp_batch.  A file that is not older than the
+ * source is indexed as if it had just been converted and served.
+ */
+static ngx_int_t
+ngx_http_webp_adopt_file(ngx_http_request_t *r, ngx_http_webp_loc_conf_t *conf,
+    ngx_http_webp_convert_ctx_t *ctx)
+{
+    ngx_open_file_info_t of;
+    time_t mtime;
+    size_t size;
+
+    if (ngx_http_webp_stat_file(r, &ctx->src_path, &of) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    mtime = of.mtime;
+    size = (size_t) of.size;
+
+    if (ngx_http_webp_stat_file(r, &ctx->dst_path, &of) != NGX_OK
+        || of.mtime < mtime || of.size == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    NGX_HTTP_WEBP_LOG(NGX_LOG_DEBUG, r->connection->log, 0,
+                      "Adopting WebP file: %V", &ctx->dst_path);
+
+    ctx->cache_status = NGX_HTTP_WEBP_CACHE_HIT;
+    ctx->state = NGX_HTTP_WEBP_STATE_OK;
+    ctx->image_size = size;
+    ctx->source_mtime = mtime;
+    ctx->webp_size = (size_t) of.size;
+    ctx->segment = 0;
+    ctx->offset = 0;
+
+    /* only a plain quality is known to be the one the file was encoded at */
+
+    ctx->encoded_quality = (conf->target == NGX_HTTP_WEBP_TARGET_NONE) ? ctx->quality
+                                                                       : NGX_HTTP_WEBP_QUALITY_UNKNOWN;
+
+    ngx_http_webp_stats_add(ctx->stats, hits, 1);
+
+    if (ngx_http_webp_store_cache(r, ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "Failed to index WebP file: %V", &ctx->dst_path);
+    }
+
+    return ngx_http_webp_serve_file(r, &ctx->dst_path);
+}
+
+/*
+ * Serves a pre-generated sibling of the source, e.g. image.jpg.webp, if one
+ * of the configured suffixes exists and is not older than the source.  Both
+ * files are only stat()ed through the open file cache, serve_file() then
+ * opens the sidecar.
+ */
+static ngx_int_t
+ngx_http_webp_serve_sidecar(ngx_http_request_t *r, ngx_http_webp_loc_conf_t *conf,
+    ngx_http_webp_convert_ctx_t *ctx)
+{
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_open_file_info_t of;
+    ngx_str_t *suffix, path;
+    time_t mtime;
+    size_t root, len;
+    u_char *last;
+    ngx_uint_t i;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    last = ngx_http_map_uri_to_path(r, &ctx->src_path, &root, 0);
+    if (last == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->src_path.len = last - ctx->src_path.data;
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.test_only = 1;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    /* no source, nothing to compare against: let the static module answer */
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &ctx->src_path, &of, r->pool) != NGX_OK
+        || !of.is_file)
+    {
+        return NGX_DECLINED;
+    }
+
+    mtime = of.mtime;
+    ctx->image_size = (size_t) of.size;
+
+    suffix = conf->sidecar->elts;
+
+    for (i = 0; i < conf->sidecar->nelts; i++) {
+        len = ctx->src_path.len + suffix[i].len;
+
+        path.data = ngx_pnalloc(r->pool, len + 1);
+        if (path.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-        entry = (ngx_http_webp_cache_entry_t *) node;
+        last = ngx_cpymem(path.data, ctx->src_path.data, ctx->src_path.len);
+        last = ngx_cpymem(last, suffix[i].data, suffix[i].len);
+        *last = '\0';
+        path.len = len;
 
-        if (ngx_memcmp(entry->key, cache_key->data, cache_key->len) == 0) {
-            if (entry->expire < ngx_time()) {
-                ngx_queue_remove(&entry->queue);
-                ngx_rbtree_delete(&ctx->rbtree, node);
-                ngx_slab_free_locked(shpool, entry);
-                ngx_shmtx_unlock(&shpool->mutex);
-                return NGX_DECLINED;
-            }
+        ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+        of.test_only = 1;
+        of.valid = clcf->open_file_cache_valid;
+        of.min_uses = clcf->open_file_cache_min_uses;
+        of.errors = clcf->open_file_cache_errors;
+        of.events = clcf->open_file_cache_events;
 
-            *file_path = entry->path;
-            ngx_queue_remove(&entry->queue);
-            ngx_queue_insert_head(&ctx->queue, &entry->queue);
-            ngx_shmtx_unlock(&shpool->mutex);
-            return NGX_OK;
+        if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool) != NGX_OK
+            || !of.is_file || of.mtime < mtime)
+        {
+            continue;
         }
 
-        break;
+        NGX_HTTP_WEBP_LOG(NGX_LOG_DEBUG, r->connection->log, 0,
+                          "Serving sidecar: %V", &path);
+
+        ctx->cache_status = NGX_HTTP_WEBP_CACHE_SIDECAR;
+
+        return ngx_http_webp_serve_file(r, &path);
     }
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ctx->image_size = 0;
+
     return NGX_DECLINED;
 }
 
+/*
+ * Builds the cache key and variant path for a URI, the request URI or, in
+ * filter mode, the URI with its arguments.  The scheme lives in the codec
+ * core so ngx_webp_batch produces identical paths.
+ */
 ngx_int_t
-ngx_http_webp_store_cache(ngx_http_request_t *r, ngx_str_t *webp_path, uint8_t *webp_data, size_t webp_size)
+ngx_http_webp_cache_key(ngx_http_request_t *r, ngx_str_t *uri, ngx_uint_t quality, ngx_str_t *cache_key,
+    ngx_str_t *cache_path)
 {
     ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
-    ngx_http_webp_shm_ctx_t *ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)conf->cache_zone->shm.addr;
-    ngx_http_webp_cache_entry_t *entry;
-    ngx_rbtree_node_t *node;
-    u_char key[SHA_DIGEST_LENGTH * 2];
-
+    ngx_http_webp_params_t params;
+    u_char digest[NGX_HTTP_WEBP_DIGEST_LEN];
+    u_char *material;
+    size_t len;
     ngx_sha1_t sha1;
-    ngx_sha1_init(&sha1);
-    ngx_sha1_update(&sha1, webp_path->data, webp_path->len);
-    ngx_sha1_final(key, &sha1);
 
-    ngx_shmtx_lock(&shpool->mutex);
+    /* every parameter that changes the output is part of the key */
 
-    entry = ngx_slab_alloc_locked(shpool, sizeof(ngx_http_webp_cache_entry_t));
-    if (entry == NULL) {
-        ngx_shmtx_unlock(&shpool->mutex);
+    ngx_http_webp_params(conf, quality, &params);
+
+    len = uri->len + NGX_HTTP_WEBP_KEY_MATERIAL_LEN;
+
+    material = ngx_pnalloc(r->pool, len);
+    if (material == NULL) {
         return NGX_ERROR;
     }
 
-    node = (ngx_rbtree_node_t *)entry;
-    node->key = ngx_crc32_long(key, sizeof(key));
+    len = ngx_http_webp_codec_key_material((char *) material, len, (char *) uri->data, uri->len, &params);
+    if (len == 0) {
+        return NGX_ERROR;
+    }
 
-    ngx_memcpy(entry->key, key, sizeof(key));
-    entry->path = *webp_path;
-    entry->expire = ngx_time() + conf->cache_time;
+    ngx_sha1_init(&sha1);
+    ngx_sha1_update(&sha1, material, len);
+    ngx_sha1_final(digest, &sha1);
 
-    ngx_rbtree_insert(&ctx->rbtree, node);
-    ngx_queue_insert_head(&ctx->queue, &entry->queue);
+    cache_key->len = NGX_HTTP_WEBP_KEY_LEN;
+    cache_key->data = ngx_pnalloc(r->pool, NGX_HTTP_WEBP_KEY_LEN);
+    if (cache_key->data == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_http_webp_codec_key_hex(digest, (char *) cache_key->data);
 
-    // Write the WebP file to disk
-    ngx_file_t file;
-    ngx_memzero(&file, sizeof(ngx_file_t));
-    file.name = *webp_path;
-    file.fd = ngx_open_file(webp_path->data, NGX_FILE_WRONLY, NGX_FILE_CREATE_OR_OPEN, 0644);
+    len = conf->cache_dir.len + 1 + NGX_HTTP_WEBP_KEY_LEN + sizeof(NGX_HTTP_WEBP_CACHE_SUFFIX);
 
-    if (file.fd == NGX_INVALID_FILE) {
-        NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, r->connection->log, ngx_errno,
-                          "Failed to create WebP file: %V", webp_path);
+    cache_path->data = ngx_pnalloc(r->pool, len);
+    if (cache_path->data == NULL) {
         return NGX_ERROR;
     }
 
-    ssize_t written = ngx_write_file(&file, webp_data, webp_size, 0);
-    ngx_close_file(file.fd);
-
-    if (written != webp_size) {
-        NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, r->connection->log, ngx_errno,
-                          "Failed to write WebP file: %V", webp_path);
+    cache_path->len = ngx_http_webp_codec_cache_path((char *) cache_path->data, len,
+                                                     (char *) conf->cache_dir.data, conf->cache_dir.len,
+                                                     (char *) cache_key->data);
+    if (cache_path->len == 0) {
         return NGX_ERROR;
     }
 
     return NGX_OK;
 }
 
-ngx_int_t
-ngx_http_webp_invalidate_cache(ngx_http_request_t *r)
+void
+ngx_http_webp_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
 {
-    ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
-    ngx_http_webp_shm_ctx_t *ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
-    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)conf->cache_zone->shm.addr;
-    ngx_str_t cache_key;
-    ngx_http_webp_cache_entry_t *entry;
-    ngx_rbtree_node_t *node, *sentinel;
-    uint32_t hash;
+    ngx_http_webp_cache_entry_t *e, *t;
+    ngx_rbtree_node_t **p;
 
-    if (ngx_http_arg(r, (u_char *) "cache_key", 9, &cache_key) != NGX_OK) {
-        return NGX_HTTP_BAD_REQUEST;
-    }
+    for ( ;; ) {
 
-    hash = ngx_crc32_long(cache_key.data, cache_key.len);
+        if (node->key < temp->key) {
+            p = &temp->left;
 
-    ngx_shmtx_lock(&shpool->mutex);
+        } else if (node->key > temp->key) {
+            p = &temp->right;
 
-    node = ctx->rbtree.root;
-    sentinel = ctx->rbtree.sentinel;
+        } else {
+            e = (ngx_http_webp_cache_entry_t *) node;
+            t = (ngx_http_webp_cache_entry_t *) temp;
 
-    while (node != sentinel) {
-        if (hash < node->key) {
-            node = node->left;
-            continue;
+            p = (ngx_memcmp(e->key, t->key, NGX_HTTP_WEBP_KEY_LEN) < 0) ? &temp->left : &temp->right;
         }
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
+        if (*p == sentinel) {
+            break;
         }
 
-        entry = (ngx_http_webp_cache_entry_t *) node;
+        temp = *p;
+    }
 
-        if (ngx_memcmp(entry->key, cache_key.data, cache_key.len) == 0) {
-            ngx_queue_remove(&entry->queue);
-            ngx_rbtree_delete(&ctx->rbtree, node);
-            ngx_slab_free_locked(shpool, entry);
-            ngx_shmtx_unlock(&shpool->mutex);
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
 
-            // Delete the file from disk
-            if (ngx_delete_file(entry->path.data) == NGX_FILE_ERROR) {
-                NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, r->connection->log, ngx_errno,
-                                  "Failed to delete cache file: %V", &entry->path);
-            }
+/*
+ * The source index is ordered by URI so prefix purges can walk a range.
+ */
+void
+ngx_http_webp_source_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_http_webp_source_t *s, *t;
+    ngx_rbtree_node_t **p;
+
+    s = (ngx_http_webp_source_t *) node;
+
+    for ( ;; ) {
+        t = (ngx_http_webp_source_t *) temp;
+
+        p = (ngx_memn2cmp(s->uri, t->uri, s->len, t->len) < 0) ? &temp->left : &temp->right;
 
-            return NGX_HTTP_OK;
+        if (*p == sentinel) {
+            break;
         }
 
-        break;
+        temp = *p;
     }
 
-    ngx_shmtx_unlock(&shpool->mutex);
-    return NGX_HTTP_NOT_FOUND;
-}
\ No newline at end of file
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/*
+ * On reload a zone of unchanged name and size is passed its old data, so
+ * the index, the LRU and the segment slots survive; only max_entries is
+ * taken from the new configuration.
+ */
+ngx_int_t
+ngx_http_webp_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_webp_zone_conf_t *zcf = shm_zone->data;
+    ngx_http_webp_shm_ctx_t *ctx = data;
+    ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    ngx_uint_t i;
+    size_t len;
+
+    if (ctx != NULL) {
+        ctx->max_entries = zcf->max_entries;
+        shm_zone->data = ctx;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        ctx = shpool->data;
+        ctx->max_entries = zcf->max_entries;
+        shm_zone->data = ctx;
+        return NGX_OK;
+    }
+
+    ctx = ngx_slab_calloc(shpool, sizeof(ngx_http_webp_shm_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&ctx->rbtree, &ctx->sentinel, ngx_http_webp_rbtree_insert_value);
+    ngx_rbtree_init(&ctx->sources, &ctx->sources_sentinel, ngx_http_webp_source_insert_value);
+    ngx_queue_init(&ctx->queue);
+
+    for (i = 0; i < NGX_HTTP_WEBP_SEGMENTS; i++) {
+        ngx_queue_init(&ctx->segments[i].entries);
+    }
+
+    ctx->max_entries = zcf->max_entries;
+
+    /* segment files of an earlier zone must not be mistaken for this one's */
+
+    ctx->generation = ((ngx_uint_t) ngx_time() ^ ((ngx_uint_t) ngx_pid << 20)) & 0xffffffff;
+
+    shpool->data = ctx;
+
+    len = sizeof(" in webp cache zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in webp cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+    /* running out of zone memory is handled by evicting entries */
+
+    shpool->log_nomem = 0;
+
+    shm_zone->data = ctx;
+
+    return NGX_OK;
+}
+
+static ngx_http_webp_source_t *
+ngx_http_webp_source_find(ngx_http_webp_shm_ctx_t *ctx, ngx_str_t *uri)
+{
+    ngx_http_webp_source_t *source;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_int_t rc;
+
+    node = ctx->sources.root;
+    sentinel = ctx->sources.sentinel;
+
+    while (node != sentinel) {
+        source = (ngx_http_webp_source_t *) node;
+
+        rc = ngx_memn2cmp(uri->data, source->uri, uri->len, source->len);
+
+        if (rc == 0) {
+            return source;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* first source whose URI is not less than prefix */
+static ngx_http_webp_source_t *
+ngx_http_webp_source_lower_bound(ngx_http_webp_shm_ctx_t *ctx, ngx_str_t *prefix)
+{
+    ngx_http_webp_source_t *source, *found;
+    ngx_rbtree_node_t *node, *sentinel;
+
+    found = NULL;
+    node = ctx->sources.root;
+    sentinel = ctx->sources.sentinel;
+
+    while (node != sentinel) {
+        source = (ngx_http_webp_source_t *) node;
+
+        if (ngx_memn2cmp(source->uri, prefix->data, source->len, prefix->len) >= 0) {
+            found = source;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Unlinks an entry from the index, the LRU queue and its source, freeing
+ * the source once its last variant is gone.  The caller holds the mutex.
+ */
+void
+ngx_http_webp_cache_delete_locked(ngx_http_webp_shm_ctx_t *ctx, ngx_slab_pool_t *shpool, ngx_http_webp_cache_entry_t *entry)
+{
+    ngx_http_webp_source_t *source = entry->source;
+
+    ngx_queue_remove(&entry->queue);
+    ngx_rbtree_delete(&ctx->rbtree, &entry->node);
+    ctx->entries--;
+
+    if (entry->state == NGX_HTTP_WEBP_STATE_OK) {
+        ctx->size -= entry->size;
+    }
+
+    if (entry->segment) {
+        ngx_queue_remove(&entry->packed);
+        ngx_http_webp_segment_release(ctx, entry->segment, entry->size);
+    }
+
+    if (source != NULL) {
+        ngx_queue_remove(&entry->variant);
+
+        if (ngx_queue_empty(&source->variants)) {
+            ngx_rbtree_delete(&ctx->sources, &source->node);
+            ngx_slab_free_locked(shpool, source);
+        }
+    }
+
+    ngx_slab_free_locked(shpool, entry);
+}
+
+/* allocates from the zone, evicting least recently used entries if full */
+static void *
+ngx_http_webp_cache_alloc_locked(ngx_http_webp_shm_ctx_t *ctx, ngx_slab_pool_t *shpool, size_t size)
+{
+    ngx_http_webp_cache_entry_t *entry;
+    ngx_queue_t *q;
+    ngx_uint_t tries;
+    void *p;
+
+    for (tries = 0; tries < 16; tries++) {
+        p = ngx_slab_alloc_locked(shpool, size);
+        if (p != NULL) {
+            return p;
+        }
+
+        if (ngx_queue_empty(&ctx->queue)) {
+            break;
+        }
+
+        q = ngx_queue_last(&ctx->queue);
+        entry = ngx_queue_data(q, ngx_http_webp_cache_entry_t, queue);
+
+        ngx_http_webp_cache_delete_locked(ctx, shpool, entry);
+        ngx_http_webp_stats_add(&ctx->stats, evictions, 1);
+    }
+
+    return NULL;
+}
+
+/* max_entries bounds the index regardless of the zone size */
+static void
+ngx_http_webp_cache_limit_locked(ngx_http_webp_shm_ctx_t *ctx, ngx_slab_pool_t *shpool)
+{
+    ngx_http_webp_cache_entry_t *entry;
+
+    while (ctx->max_entries && ctx->entries >= ctx->max_entries && !ngx_queue_empty(&ctx->queue)) {
+        entry = ngx_queue_data(ngx_queue_last(&ctx->queue), ngx_http_webp_cache_entry_t, queue);
+        ngx_http_webp_cache_delete_locked(ctx, shpool, entry);
+        ngx_http_webp_stats_add(&ctx->stats, evictions, 1);
+    }
+}
+
+/*
+ * Finds or creates the source node of a URI.  Allocating may evict, so it
+ * must not be called while an entry of the caller is on the LRU queue and
+ * not yet attached.
+ */
+static ngx_http_webp_source_t *
+ngx_http_webp_source_get_locked(ngx_http_webp_shm_ctx_t *ctx, ngx_slab_pool_t *shpool, ngx_str_t *uri)
+{
+    ngx_http_webp_source_t *source;
+
+    source = ngx_http_webp_source_find(ctx, uri);
+
+    if (source == NULL) {
+        source = ngx_http_webp_cache_alloc_locked(ctx, shpool,
+                                                  offsetof(ngx_http_webp_source_t, uri) + uri->len);
+        if (source == NULL) {
+            return NULL;
+        }
+
+        source->len = (u_short) uri->len;
+        ngx_memcpy(source->uri, uri->data, uri->len);
+        ngx_queue_init(&source->variants);
+
+        ngx_rbtree_insert(&ctx->sources, &source->node);
+    }
+
+    return source;
+}
+
+ngx_http_webp_cache_entry_t *
+ngx_http_webp_cache_find(ngx_http_webp_shm_ctx_t *ctx, ngx_str_t *cache_key, uint32_t hash)
+{
+    ngx_http_webp_cache_entry_t *entry;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_int_t rc;
+
+    if (cache_key->len != NGX_HTTP_WEBP_KEY_LEN) {
+        return NULL;
+    }
+
+    node = ctx->rbtree.root;
+    sentinel = ctx->rbtree.sentinel;
+
+    while (node != sentinel) {
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key, CRC32 collisions are resolved by the full key */
+
+        entry = (ngx_http_webp_cache_entry_t *) node;
+
+        rc = ngx_memcmp(cache_key->data, entry->key, NGX_HTTP_WEBP_KEY_LEN);
+
+        if (rc == 0) {
+            return entry;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * Sets rctx->cache_status to HIT, MISS, STALE or NEGATIVE; on a hit the
+ * source fingerprint and sizes recorded at conversion time are copied into
+ * rctx as well, which is all that is needed to build the response
+ * validators.  NGX_DONE means the key has a live negative entry and the
+ * original must be served.
+ */
+ngx_int_t
+ngx_http_webp_lookup_cache(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *rctx)
+{
+    ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+    ngx_http_webp_shm_ctx_t *ctx;
+    ngx_slab_pool_t *shpool;
+    ngx_http_webp_cache_entry_t *entry;
+    ngx_http_webp_segment_t *slot;
+    ngx_pool_cleanup_t *cln;
+    ngx_str_t *cache_key = &rctx->cache_key;
+
+    rctx->cache_status = NGX_HTTP_WEBP_CACHE_MISS;
+
+    if (conf->cache_zone == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
+    shpool = (ngx_slab_pool_t *)conf->cache_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    entry = ngx_http_webp_cache_find(ctx, cache_key, ngx_crc32_long(cache_key->data, cache_key->len));
+
+    if (entry == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    if (entry->expire < ngx_time()) {
+        rctx->cache_status = NGX_HTTP_WEBP_CACHE_STALE;
+
+        ngx_http_webp_cache_delete_locked(ctx, shpool, entry);
+        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_http_webp_stats_add(&ctx->stats, expired, 1);
+        return NGX_DECLINED;
+    }
+
+    if (entry->state != NGX_HTTP_WEBP_STATE_OK) {
+        rctx->cache_status = NGX_HTTP_WEBP_CACHE_NEGATIVE;
+        rctx->state = entry->state;
+        rctx->image_size = entry->source_size;
+        rctx->source_mtime = entry->source_mtime;
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DONE;
+    }
+
+    rctx->cache_status = NGX_HTTP_WEBP_CACHE_HIT;
+    rctx->image_size = entry->source_size;
+    rctx->source_mtime = entry->source_mtime;
+    rctx->encoded_quality = entry->quality;
+    rctx->webp_size = entry->size;
+    rctx->segment = entry->segment;
+    rctx->offset = entry->offset;
+
+    /* keeps compaction from deleting the segment before it is opened */
+
+    if (entry->segment) {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+
+        if (cln != NULL) {
+            slot = &ctx->segments[entry->segment % NGX_HTTP_WEBP_SEGMENTS];
+            (void) ngx_atomic_fetch_add(&slot->refs, 1);
+
+            cln->handler = ngx_http_webp_segment_unref;
+            cln->data = slot;
+        }
+    }
+
+    ngx_queue_remove(&entry->queue);
+    ngx_queue_insert_head(&ctx->queue, &entry->queue);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+/*
+ * Drops the entry lookup_cache() returned once the caller found it no longer
+ * matches its source or its file is gone, and resets rctx so the request can go on
+ * as a miss.  An entry that was replaced in the meantime is left alone.
+ */
+void
+ngx_http_webp_invalidate_cache(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *rctx)
+{
+    ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+    ngx_http_webp_shm_ctx_t *ctx;
+    ngx_slab_pool_t *shpool;
+    ngx_http_webp_cache_entry_t *entry;
+    ngx_str_t *cache_key = &rctx->cache_key;
+
+    if (conf->cache_zone != NULL) {
+        ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
+        shpool = (ngx_slab_pool_t *)conf->cache_zone->shm.addr;
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        entry = ngx_http_webp_cache_find(ctx, cache_key, ngx_crc32_long(cache_key->data, cache_key->len));
+
+        if (entry != NULL
+            && entry->source_mtime == rctx->source_mtime
+            && entry->source_size == rctx->image_size
+            && entry->segment == rctx->segment
+            && entry->offset == rctx->offset)
+        {
+            ngx_http_webp_cache_delete_locked(ctx, shpool, entry);
+            ngx_http_webp_stats_add(&ctx->stats, expired, 1);
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    rctx->cache_status = NGX_HTTP_WEBP_CACHE_STALE;
+    rctx->served = 0;
+    rctx->state = NGX_HTTP_WEBP_STATE_OK;
+    rctx->image_size = 0;
+    rctx->source_mtime = 0;
+    rctx->encoded_quality = 0;
+    rctx->webp_size = 0;
+    rctx->segment = 0;
+    rctx->offset = 0;
+}
+
+/*
+ * Indexes a variant the thread handler has already written to
+ * "<cache_dir>/<key>.webp" or into a segment, or, for any other
+ * rctx->state, a negative entry that keeps the key from being converted
+ * again until it expires.  Segment space of a variant that is not indexed
+ * is released here.
+ */
+ngx_int_t
+ngx_http_webp_store_cache(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *rctx)
+{
+    ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+    ngx_http_webp_shm_ctx_t *ctx;
+    ngx_slab_pool_t *shpool;
+    ngx_http_webp_cache_entry_t *entry;
+    ngx_http_webp_source_t *source;
+    ngx_str_t *cache_key = &rctx->cache_key;
+    uint32_t hash;
+    time_t valid;
+
+    if (conf->cache_zone == NULL) {
+        return NGX_OK;
+    }
+
+    switch (rctx->state) {
+    case NGX_HTTP_WEBP_STATE_ORIGINAL_BETTER:
+        valid = conf->original_better_time;
+        break;
+    case NGX_HTTP_WEBP_STATE_DECODE_FAILED:
+        valid = conf->decode_failed_time;
+        break;
+    case NGX_HTTP_WEBP_STATE_TOO_LARGE:
+        valid = conf->too_large_time;
+        break;
+    default:
+        valid = conf->cache_time;
+        break;
+    }
+
+    ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
+    shpool = (ngx_slab_pool_t *)conf->cache_zone->shm.addr;
+    hash = ngx_crc32_long(cache_key->data, cache_key->len);
+
+    if (valid == 0 || r->uri.len > NGX_HTTP_WEBP_MAX_URI_LEN) {
+        if (rctx->segment) {
+            ngx_http_webp_segment_release(ctx, rctx->segment, rctx->webp_size);
+        }
+
+        return (valid == 0) ? NGX_OK : NGX_DECLINED;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    entry = ngx_http_webp_cache_find(ctx, cache_key, hash);
+
+    if (entry == NULL) {
+        ngx_http_webp_cache_limit_locked(ctx, shpool);
+
+        entry = ngx_http_webp_cache_alloc_locked(ctx, shpool, sizeof(ngx_http_webp_cache_entry_t));
+        if (entry == NULL) {
+            goto failed;
+        }
+
+        /* eviction above may have freed the source, look it up afterwards */
+
+        source = ngx_http_webp_source_get_locked(ctx, shpool, &r->uri);
+        if (source == NULL) {
+            ngx_slab_free_locked(shpool, entry);
+            goto failed;
+        }
+
+        entry->node.key = hash;
+        entry->source = source;
+        ngx_memcpy(entry->key, cache_key->data, NGX_HTTP_WEBP_KEY_LEN);
+
+        ngx_rbtree_insert(&ctx->rbtree, &entry->node);
+        ngx_queue_insert_tail(&source->variants, &entry->variant);
+        ctx->entries++;
+
+    } else {
+        ngx_queue_remove(&entry->queue);
+
+        /* an entry of the cache loader learns its source on the first hit */
+
+        if (entry->source == NULL) {
+            source = ngx_http_webp_source_get_locked(ctx, shpool, &r->uri);
+
+            if (source != NULL) {
+                entry->source = source;
+                ngx_queue_insert_tail(&source->variants, &entry->variant);
+            }
+        }
+
+        if (entry->state == NGX_HTTP_WEBP_STATE_OK) {
+            ctx->size -= entry->size;
+        }
+
+        if (entry->segment) {
+            ngx_queue_remove(&entry->packed);
+            ngx_http_webp_segment_release(ctx, entry->segment, entry->size);
+        }
+    }
+
+    if (rctx->state == NGX_HTTP_WEBP_STATE_OK) {
+        ctx->size += rctx->webp_size;
+    }
+
+    entry->expire = ngx_time() + valid;
+    entry->state = (u_char) rctx->state;
+    entry->source_mtime = rctx->source_mtime;
+    entry->source_size = rctx->image_size;
+    entry->size = rctx->webp_size;
+    entry->segment = rctx->segment;
+    entry->offset = rctx->offset;
+    entry->quality = (u_char) rctx->encoded_quality;
+    ngx_queue_insert_head(&ctx->queue, &entry->queue);
+
+    if (entry->segment) {
+        ngx_queue_insert_tail(&ctx->segments[entry->segment % NGX_HTTP_WEBP_SEGMENTS].entries,
+                              &entry->packed);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (rctx->segment) {
+        ngx_http_webp_segment_release(ctx, rctx->segment, rctx->webp_size);
+    }
+
+    return NGX_ERROR;
+}
+
+/*
+ * Indexes a variant file the cache loader found on disk.  Nothing is known
+ * about its source yet: source_size stays 0 and source_mtime holds the
+ * file's own mtime until the first hit compares it with the source and
+ * stores the real fingerprint.  Such entries go to the cold end of the LRU
+ * queue.  NGX_DECLINED means the key is already indexed.
+ */
+ngx_int_t
+ngx_http_webp_cache_add_file(ngx_shm_zone_t *zone, ngx_str_t *key, size_t size, time_t mtime, time_t valid)
+{
+    ngx_http_webp_shm_ctx_t *ctx;
+    ngx_slab_pool_t *shpool;
+    ngx_http_webp_cache_entry_t *entry;
+    uint32_t hash;
+
+    ctx = zone->data;
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    hash = ngx_crc32_long(key->data, key->len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (ngx_http_webp_cache_find(ctx, key, hash) != NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_http_webp_cache_limit_locked(ctx, shpool);
+
+    entry = ngx_http_webp_cache_alloc_locked(ctx, shpool, sizeof(ngx_http_webp_cache_entry_t));
+    if (entry == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(entry, sizeof(ngx_http_webp_cache_entry_t));
+
+    entry->node.key = hash;
+    ngx_memcpy(entry->key, key->data, NGX_HTTP_WEBP_KEY_LEN);
+
+    entry->expire = ngx_time() + valid;
+    entry->state = NGX_HTTP_WEBP_STATE_OK;
+    entry->source_mtime = mtime;
+    entry->size = size;
+    entry->quality = NGX_HTTP_WEBP_QUALITY_UNKNOWN;
+
+    ngx_rbtree_insert(&ctx->rbtree, &entry->node);
+    ngx_queue_insert_tail(&ctx->queue, &entry->queue);
+    ctx->entries++;
+    ctx->size += size;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+/*
+ * Removes the variants of every source matching the purge request from the
+ * index and deletes their files.  Keys are collected under the mutex and
+ * the files unlinked after it is released.  A conversion running meanwhile
+ * may index a key again before its file is gone, so the keys are looked up
+ * once more afterwards and such entries dropped: the next request adopts
+ * or converts the variant.  Files are looked for in the directory the zone
+ * serves, the purge location's own webp_cache_dir may be a different one.
+ */
+static ngx_int_t
+ngx_http_webp_purge_handler(ngx_http_request_t *r)
+{
+    ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+    ngx_http_webp_shm_ctx_t *ctx;
+    ngx_slab_pool_t *shpool;
+    ngx_http_webp_source_t *source, *next;
+    ngx_http_webp_cache_entry_t *entry;
+    ngx_rbtree_node_t *node;
+    ngx_queue_t *q;
+    ngx_array_t keys;
+    ngx_str_t arg, target, key, *dir;
+    uint32_t hash;
+    ngx_uint_t prefix, last, i, sources, failed;
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+    u_char *k, *dst, *src;
+    u_char path[NGX_MAX_PATH];
+
+    if (!(r->method & NGX_HTTP_DELETE)
+        && !(r->method_name.len == 5 && ngx_strncmp(r->method_name.data, "PURGE", 5) == 0))
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (conf->cache_zone == NULL) {
+        NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, r->connection->log, 0,
+                          "webp_purge: no cache zone configured for this location");
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "uri", 3, &arg) == NGX_OK) {
+        prefix = 0;
+
+    } else if (ngx_http_arg(r, (u_char *) "prefix", 6, &arg) == NGX_OK) {
+        prefix = 1;
+
+    } else {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (arg.len == 0) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    target.data = ngx_pnalloc(r->pool, arg.len);
+    if (target.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    src = arg.data;
+    dst = target.data;
+    ngx_unescape_uri(&dst, &src, arg.len, NGX_UNESCAPE_URI);
+    target.len = dst - target.data;
+
+    if (ngx_array_init(&keys, r->pool, 16, NGX_HTTP_WEBP_KEY_LEN) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
+    shpool = (ngx_slab_pool_t *)conf->cache_zone->shm.addr;
+    sources = 0;
+    failed = 0;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    source = prefix ? ngx_http_webp_source_lower_bound(ctx, &target)
+                    : ngx_http_webp_source_find(ctx, &target);
+
+    while (source != NULL
+           && source->len >= target.len
+           && ngx_memcmp(source->uri, target.data, target.len) == 0)
+    {
+        next = NULL;
+
+        if (prefix) {
+            node = ngx_rbtree_next(&ctx->sources, &source->node);
+            next = node ? (ngx_http_webp_source_t *) node : NULL;
+        }
+
+        /* deleting the last variant frees the source, stop right there */
+
+        do {
+            q = ngx_queue_head(&source->variants);
+            last = (ngx_queue_next(q) == ngx_queue_sentinel(&source->variants));
+            entry = ngx_queue_data(q, ngx_http_webp_cache_entry_t, variant);
+
+            /* an entry that cannot be remembered is not removed either */
+
+            k = ngx_array_push(&keys);
+            if (k == NULL) {
+                failed = 1;
+                break;
+            }
+
+            ngx_memcpy(k, entry->key, NGX_HTTP_WEBP_KEY_LEN);
+
+            ngx_http_webp_cache_delete_locked(ctx, shpool, entry);
+
+        } while (!last);
+
+        if (failed) {
+            break;
+        }
+
+        sources++;
+        source = next;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    dir = ngx_http_webp_zone_cache_dir(r, conf->cache_zone);
+    if (dir == NULL) {
+        dir = &conf->cache_dir;
+    }
+
+    k = keys.elts;
+    key.len = NGX_HTTP_WEBP_KEY_LEN;
+
+    for (i = 0; i < keys.nelts; i++, k += NGX_HTTP_WEBP_KEY_LEN) {
+        if (ngx_http_webp_codec_cache_path((char *) path, sizeof(path),
+                                           (char *) dir->data, dir->len, (char *) k) == 0)
+        {
+            continue;
+        }
+
+        if (ngx_delete_file(path) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+            NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                              "Failed to delete cache file: %s", path);
+        }
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    k = keys.elts;
+
+    for (i = 0; i < keys.nelts; i++, k += NGX_HTTP_WEBP_KEY_LEN) {
+        key.data = k;
+        hash = ngx_crc32_long(k, NGX_HTTP_WEBP_KEY_LEN);
+
+        entry = ngx_http_webp_cache_find(ctx, &key, hash);
+
+        if (entry != NULL && entry->state == NGX_HTTP_WEBP_STATE_OK && entry->segment == 0) {
+            ngx_http_webp_cache_delete_locked(ctx, shpool, entry);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (failed) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    NGX_HTTP_WEBP_LOG(NGX_LOG_INFO, r->connection->log, 0,
+                      "purged %ui variants of %ui sources for %s \"%V\"",
+                      keys.nelts, sources, prefix ? "prefix" : "uri", &target);
+
+    b = ngx_create_temp_buf(r->pool, sizeof("{\"sources\":,\"variants\":}" CRLF) + 2 * NGX_INT_T_LEN);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "{\"sources\":%ui,\"variants\":%ui}" CRLF, sources, keys.nelts);
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = sources ? NGX_HTTP_OK : NGX_HTTP_NOT_FOUND;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+char *
+ngx_http_webp_purge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_webp_purge_handler;
+
+    return NGX_CONF_OK;
+}
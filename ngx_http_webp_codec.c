@@ -0,0 +1,1447 @@
+#include "ngx_http_webp_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <setjmp.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+#include <png.h>
+#include <webp/encode.h>
+#include <webp/decode.h>
+#include <avif/avif.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef NGX_HTTP_WEBP_JXL_ENABLED
+#include <jxl/decode.h>
+#endif
+
+#ifdef NGX_HTTP_WEBP_GIF_ENABLED
+#include <gif_lib.h>
+#include <webp/mux.h>
+#endif
+
+/*
+ * 64 megapixels, 256MB of RGBA.  Header dimensions are checked against it
+ * before anything is allocated, a few bytes of JPEG can claim 65535x65535.
+ */
+#define NGX_HTTP_WEBP_MAX_PIXELS       (1 << 26)
+
+#define ngx_http_webp_too_many_pixels(w, h)                                   \
+    ((w) == 0 || (h) == 0 || (uint64_t) (w) * (h) > NGX_HTTP_WEBP_MAX_PIXELS)
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} ngx_http_webp_jpeg_error_t;
+
+static uint64_t
+ngx_http_webp_codec_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+ngx_http_webp_codec_has_suffix(const char *path, size_t len, const char *suffix)
+{
+    size_t n = strlen(suffix);
+
+    return len >= n && strncasecmp(path + len - n, suffix, n) == 0;
+}
+
+ngx_http_webp_format_e
+ngx_http_webp_codec_format(const char *path, size_t len)
+{
+    if (ngx_http_webp_codec_has_suffix(path, len, ".jpg")
+        || ngx_http_webp_codec_has_suffix(path, len, ".jpeg"))
+    {
+        return NGX_HTTP_WEBP_FORMAT_JPEG;
+    }
+
+    if (ngx_http_webp_codec_has_suffix(path, len, ".png")) {
+        return NGX_HTTP_WEBP_FORMAT_PNG;
+    }
+
+    if (ngx_http_webp_codec_has_suffix(path, len, ".avif")) {
+        return NGX_HTTP_WEBP_FORMAT_AVIF;
+    }
+
+#ifdef NGX_HTTP_WEBP_JXL_ENABLED
+    if (ngx_http_webp_codec_has_suffix(path, len, ".jxl")) {
+        return NGX_HTTP_WEBP_FORMAT_JXL;
+    }
+#endif
+
+#ifdef NGX_HTTP_WEBP_GIF_ENABLED
+    if (ngx_http_webp_codec_has_suffix(path, len, ".gif")) {
+        return NGX_HTTP_WEBP_FORMAT_GIF;
+    }
+#endif
+
+    return NGX_HTTP_WEBP_FORMAT_UNKNOWN;
+}
+
+static void
+ngx_http_webp_jpeg_error_exit(j_common_ptr cinfo)
+{
+    ngx_http_webp_jpeg_error_t *err = (ngx_http_webp_jpeg_error_t *) cinfo->err;
+
+    longjmp(err->jmp, 1);
+}
+
+static void
+ngx_http_webp_jpeg_output_message(j_common_ptr cinfo)
+{
+    /* keep libjpeg quiet, failures are reported by the caller */
+}
+
+static int
+ngx_http_webp_decode_jpeg(const uint8_t *data, size_t size, ngx_http_webp_image_t *img)
+{
+    struct jpeg_decompress_struct cinfo;
+    ngx_http_webp_jpeg_error_t jerr;
+    uint8_t *volatile rgba = NULL;
+    JSAMPROW row;
+    uint8_t *dst;
+    int x;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = ngx_http_webp_jpeg_error_exit;
+    jerr.pub.output_message = ngx_http_webp_jpeg_output_message;
+
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(rgba);
+        return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *) data, size);
+
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK
+        || ngx_http_webp_too_many_pixels(cinfo.image_width, cinfo.image_height))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    img->width = cinfo.output_width;
+    img->height = cinfo.output_height;
+    img->stride = img->width * 4;
+    img->opaque = 1;
+
+    rgba = malloc((size_t) img->stride * img->height);
+    if (rgba == NULL) {
+        jpeg_destroy_decompress(&cinfo);
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    /* decode RGB into the tail of each RGBA row, then expand in place */
+    while (cinfo.output_scanline < cinfo.output_height) {
+        dst = rgba + (size_t) cinfo.output_scanline * img->stride;
+        row = dst + img->width;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+
+        for (x = 0; x < img->width; x++) {
+            dst[x * 4] = row[x * 3];
+            dst[x * 4 + 1] = row[x * 3 + 1];
+            dst[x * 4 + 2] = row[x * 3 + 2];
+            dst[x * 4 + 3] = 0xff;
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    img->rgba = rgba;
+
+    return NGX_HTTP_WEBP_CODEC_OK;
+}
+
+static int
+ngx_http_webp_decode_png(const uint8_t *data, size_t size, ngx_http_webp_image_t *img)
+{
+    png_image image;
+    uint8_t *rgba;
+
+    memset(&image, 0, sizeof(png_image));
+    image.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_memory(&image, data, size)) {
+        return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+    }
+
+    if (ngx_http_webp_too_many_pixels(image.width, image.height)) {
+        png_image_free(&image);
+        return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+    }
+
+    /* the flag covers both an alpha channel and a tRNS chunk */
+    img->opaque = !(image.format & PNG_FORMAT_FLAG_ALPHA);
+
+    image.format = PNG_FORMAT_RGBA;
+
+    rgba = malloc(PNG_IMAGE_SIZE(image));
+    if (rgba == NULL) {
+        png_image_free(&image);
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    if (!png_image_finish_read(&image, NULL, rgba, 0, NULL)) {
+        free(rgba);
+        png_image_free(&image);
+        return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+    }
+
+    img->rgba = rgba;
+    img->width = image.width;
+    img->height = image.height;
+    img->stride = PNG_IMAGE_ROW_STRIDE(image);
+
+    return NGX_HTTP_WEBP_CODEC_OK;
+}
+
+static int
+ngx_http_webp_decode_avif(const uint8_t *data, size_t size, ngx_http_webp_image_t *img)
+{
+    avifDecoder *decoder;
+    avifRGBImage rgb;
+    int rc = NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+
+    decoder = avifDecoderCreate();
+    if (decoder == NULL) {
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    if (avifDecoderSetIOMemory(decoder, data, size) != AVIF_RESULT_OK
+        || avifDecoderParse(decoder) != AVIF_RESULT_OK
+        || ngx_http_webp_too_many_pixels(decoder->image->width, decoder->image->height)
+        || avifDecoderNextImage(decoder) != AVIF_RESULT_OK)
+    {
+        goto done;
+    }
+
+    avifRGBImageSetDefaults(&rgb, decoder->image);
+    rgb.format = AVIF_RGB_FORMAT_RGBA;
+    rgb.depth = 8;
+    rgb.rowBytes = rgb.width * 4;
+    rgb.pixels = malloc((size_t) rgb.rowBytes * rgb.height);
+
+    if (rgb.pixels == NULL) {
+        rc = NGX_HTTP_WEBP_CODEC_ERROR;
+        goto done;
+    }
+
+    if (avifImageYUVToRGB(decoder->image, &rgb) != AVIF_RESULT_OK) {
+        free(rgb.pixels);
+        goto done;
+    }
+
+    img->rgba = rgb.pixels;
+    img->width = rgb.width;
+    img->height = rgb.height;
+    img->stride = rgb.rowBytes;
+    img->opaque = (decoder->image->alphaPlane == NULL);
+    rc = NGX_HTTP_WEBP_CODEC_OK;
+
+done:
+    avifDecoderDestroy(decoder);
+    return rc;
+}
+
+#ifdef NGX_HTTP_WEBP_JXL_ENABLED
+static int
+ngx_http_webp_decode_jxl(const uint8_t *data, size_t size, ngx_http_webp_image_t *img)
+{
+    JxlDecoder *decoder;
+    JxlDecoderStatus status;
+    JxlBasicInfo info;
+    JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+    uint8_t *rgba = NULL;
+    size_t buffer_size;
+    int rc = NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+
+    decoder = JxlDecoderCreate(NULL);
+    if (decoder == NULL) {
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    if (JxlDecoderSubscribeEvents(decoder, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS
+        || JxlDecoderSetInput(decoder, data, size) != JXL_DEC_SUCCESS)
+    {
+        goto done;
+    }
+
+    JxlDecoderCloseInput(decoder);
+
+    for ( ;; ) {
+        status = JxlDecoderProcessInput(decoder);
+
+        if (status == JXL_DEC_BASIC_INFO) {
+            if (JxlDecoderGetBasicInfo(decoder, &info) != JXL_DEC_SUCCESS
+                || ngx_http_webp_too_many_pixels(info.xsize, info.ysize))
+            {
+                goto done;
+            }
+            continue;
+        }
+
+        if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+            if (JxlDecoderImageOutBufferSize(decoder, &format, &buffer_size) != JXL_DEC_SUCCESS) {
+                goto done;
+            }
+
+            rgba = malloc(buffer_size);
+            if (rgba == NULL) {
+                rc = NGX_HTTP_WEBP_CODEC_ERROR;
+                goto done;
+            }
+
+            if (JxlDecoderSetImageOutBuffer(decoder, &format, rgba, buffer_size) != JXL_DEC_SUCCESS) {
+                goto done;
+            }
+            continue;
+        }
+
+        if (status == JXL_DEC_FULL_IMAGE) {
+            /* only the first frame is converted */
+            break;
+        }
+
+        goto done;
+    }
+
+    img->rgba = rgba;
+    img->width = info.xsize;
+    img->height = info.ysize;
+    img->stride = info.xsize * 4;
+    img->opaque = (info.alpha_bits == 0);
+    rgba = NULL;
+    rc = NGX_HTTP_WEBP_CODEC_OK;
+
+done:
+    free(rgba);
+    JxlDecoderDestroy(decoder);
+    return rc;
+}
+#endif
+
+#ifdef NGX_HTTP_WEBP_GIF_ENABLED
+
+#define NGX_HTTP_WEBP_GIF_END          1
+
+/*
+ * Streaming GIF reader: frames are decoded one at a time onto a single
+ * ARGB canvas, plus a saved copy only while a frame uses DISPOSE_PREVIOUS.
+ */
+typedef struct {
+    GifFileType *gif;
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    uint32_t *canvas;
+    uint32_t *saved;
+    GifByteType *line;
+    int width;
+    int height;
+    int loop_count;
+    int delay;
+    int transparent;
+    int disposal;
+    int x, y, w, h;
+} ngx_http_webp_gif_t;
+
+static int
+ngx_http_webp_gif_read(GifFileType *gif, GifByteType *buf, int len)
+{
+    ngx_http_webp_gif_t *g = gif->UserData;
+    size_t n;
+
+    n = g->size - g->pos;
+    if ((size_t) len < n) {
+        n = len;
+    }
+
+    memcpy(buf, g->data + g->pos, n);
+    g->pos += n;
+
+    return (int) n;
+}
+
+static int
+ngx_http_webp_gif_open(ngx_http_webp_gif_t *g, const uint8_t *data, size_t size)
+{
+    int err;
+
+    memset(g, 0, sizeof(ngx_http_webp_gif_t));
+
+    g->data = data;
+    g->size = size;
+    g->transparent = NO_TRANSPARENT_COLOR;
+    g->disposal = DISPOSAL_UNSPECIFIED;
+
+    g->gif = DGifOpen(g, ngx_http_webp_gif_read, &err);
+    if (g->gif == NULL) {
+        return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+    }
+
+    g->width = g->gif->SWidth;
+    g->height = g->gif->SHeight;
+
+    if (g->width <= 0 || g->height <= 0 || ngx_http_webp_too_many_pixels(g->width, g->height)) {
+        return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+    }
+
+    /* the canvas starts out transparent, as browsers render it */
+
+    g->canvas = calloc((size_t) g->width * g->height, sizeof(uint32_t));
+    g->line = malloc(g->width);
+
+    if (g->canvas == NULL || g->line == NULL) {
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    return NGX_HTTP_WEBP_CODEC_OK;
+}
+
+static void
+ngx_http_webp_gif_close(ngx_http_webp_gif_t *g)
+{
+    int err;
+
+    if (g->gif) {
+#if (GIFLIB_MAJOR > 5 || (GIFLIB_MAJOR == 5 && GIFLIB_MINOR >= 1))
+        DGifCloseFile(g->gif, &err);
+#else
+        (void) err;
+        DGifCloseFile(g->gif);
+#endif
+    }
+
+    free(g->canvas);
+    free(g->saved);
+    free(g->line);
+}
+
+/* undoes the previous frame as its disposal method asks */
+static void
+ngx_http_webp_gif_dispose(ngx_http_webp_gif_t *g)
+{
+    int y;
+
+    if (g->w == 0 || g->h == 0) {
+        return;
+    }
+
+    for (y = g->y; y < g->y + g->h; y++) {
+        if (g->disposal == DISPOSE_BACKGROUND) {
+            memset(&g->canvas[(size_t) y * g->width + g->x], 0, g->w * sizeof(uint32_t));
+
+        } else if (g->disposal == DISPOSE_PREVIOUS && g->saved) {
+            memcpy(&g->canvas[(size_t) y * g->width + g->x],
+                   &g->saved[(size_t) y * g->width + g->x], g->w * sizeof(uint32_t));
+        }
+    }
+}
+
+static int
+ngx_http_webp_gif_frame(ngx_http_webp_gif_t *g)
+{
+    static const int offsets[] = { 0, 4, 2, 1 };
+    static const int jumps[] = { 8, 8, 4, 2 };
+    GifFileType *gif = g->gif;
+    GifImageDesc *desc;
+    ColorMapObject *cmap;
+    GifRecordType type;
+    GraphicsControlBlock gcb;
+    GifByteType *ext;
+    GifColorType *c;
+    uint32_t *row;
+    int code, pass, y, x, fy, netscape;
+
+    ngx_http_webp_gif_dispose(g);
+
+    /* a Graphic Control Extension only applies to the image that follows it */
+
+    g->delay = 0;
+    g->transparent = NO_TRANSPARENT_COLOR;
+    g->disposal = DISPOSAL_UNSPECIFIED;
+
+    for ( ;; ) {
+        if (DGifGetRecordType(gif, &type) == GIF_ERROR) {
+            return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+        }
+
+        if (type == TERMINATE_RECORD_TYPE) {
+            return NGX_HTTP_WEBP_GIF_END;
+        }
+
+        if (type == EXTENSION_RECORD_TYPE) {
+            if (DGifGetExtension(gif, &code, &ext) == GIF_ERROR) {
+                return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+            }
+
+            if (code == GRAPHICS_EXT_FUNC_CODE && ext != NULL
+                && DGifExtensionToGCB(ext[0], ext + 1, &gcb) == GIF_OK)
+            {
+                g->delay = gcb.DelayTime;
+                g->transparent = gcb.TransparentColor;
+                g->disposal = gcb.DisposalMode;
+            }
+
+            netscape = (code == APPLICATION_EXT_FUNC_CODE && ext != NULL && ext[0] == 11
+                 && memcmp(ext + 1, "NETSCAPE2.0", 11) == 0);
+
+            while (ext != NULL) {
+                if (DGifGetExtensionNext(gif, &ext) == GIF_ERROR) {
+                    return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+                }
+
+                if (netscape && ext != NULL && ext[0] >= 3 && ext[1] == 1) {
+                    g->loop_count = ext[2] | (ext[3] << 8);
+                    netscape = 0;
+                }
+            }
+
+            continue;
+        }
+
+        if (type != IMAGE_DESC_RECORD_TYPE) {
+            continue;
+        }
+
+        if (DGifGetImageDesc(gif) == GIF_ERROR) {
+            return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+        }
+
+        desc = &gif->Image;
+        cmap = desc->ColorMap ? desc->ColorMap : gif->SColorMap;
+
+        if (cmap == NULL || desc->Width <= 0 || desc->Height <= 0 || desc->Width > g->width) {
+            return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+        }
+
+        /* the rect the next call has to dispose of, clipped to the canvas */
+
+        g->x = desc->Left < g->width ? desc->Left : g->width;
+        g->y = desc->Top < g->height ? desc->Top : g->height;
+        g->w = desc->Left + desc->Width <= g->width ? desc->Width : g->width - g->x;
+        g->h = desc->Top + desc->Height <= g->height ? desc->Height : g->height - g->y;
+
+        if (g->disposal == DISPOSE_PREVIOUS) {
+            if (g->saved == NULL) {
+                g->saved = malloc((size_t) g->width * g->height * sizeof(uint32_t));
+                if (g->saved == NULL) {
+                    return NGX_HTTP_WEBP_CODEC_ERROR;
+                }
+            }
+
+            memcpy(g->saved, g->canvas, (size_t) g->width * g->height * sizeof(uint32_t));
+        }
+
+        for (pass = desc->Interlace ? 0 : 3; pass < 4; pass++) {
+            for (fy = desc->Interlace ? offsets[pass] : 0;
+                 fy < desc->Height;
+                 fy += desc->Interlace ? jumps[pass] : 1)
+            {
+                if (DGifGetLine(gif, g->line, desc->Width) == GIF_ERROR) {
+                    return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+                }
+
+                y = desc->Top + fy;
+                if (y >= g->height) {
+                    continue;
+                }
+
+                row = &g->canvas[(size_t) y * g->width];
+
+                for (x = 0; x < g->w; x++) {
+                    if (g->line[x] == g->transparent || g->line[x] >= cmap->ColorCount) {
+                        continue;
+                    }
+
+                    c = &cmap->Colors[g->line[x]];
+                    row[g->x + x] = 0xff000000u | ((uint32_t) c->Red << 16) | ((uint32_t) c->Green << 8) | c->Blue;
+                }
+            }
+        }
+
+        return NGX_HTTP_WEBP_CODEC_OK;
+    }
+}
+
+/* first frame only, for callers that want a still image */
+static int
+ngx_http_webp_decode_gif(const uint8_t *data, size_t size, ngx_http_webp_image_t *img)
+{
+    ngx_http_webp_gif_t g;
+    uint32_t argb;
+    uint8_t *p;
+    size_t i, n;
+    int rc;
+
+    rc = ngx_http_webp_gif_open(&g, data, size);
+
+    if (rc == NGX_HTTP_WEBP_CODEC_OK) {
+        rc = ngx_http_webp_gif_frame(&g);
+    }
+
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+        ngx_http_webp_gif_close(&g);
+        return rc == NGX_HTTP_WEBP_GIF_END ? NGX_HTTP_WEBP_CODEC_DECODE_FAILED : rc;
+    }
+
+    n = (size_t) g.width * g.height;
+
+    img->rgba = malloc(n * 4);
+    if (img->rgba == NULL) {
+        ngx_http_webp_gif_close(&g);
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    for (i = 0, p = img->rgba; i < n; i++, p += 4) {
+        argb = g.canvas[i];
+        p[0] = (argb >> 16) & 0xff;
+        p[1] = (argb >> 8) & 0xff;
+        p[2] = argb & 0xff;
+        p[3] = argb >> 24;
+    }
+
+    img->width = g.width;
+    img->height = g.height;
+    img->stride = g.width * 4;
+
+    ngx_http_webp_gif_close(&g);
+
+    return NGX_HTTP_WEBP_CODEC_OK;
+}
+
+/*
+ * Decodes and encodes frame by frame: each composited frame is handed to
+ * WebPAnimEncoder, which keeps its own copy for frame differencing, so the
+ * whole animation never sits in memory decoded.
+ */
+static int
+ngx_http_webp_convert_gif(const uint8_t *data, size_t size, const ngx_http_webp_params_t *params,
+    ngx_http_webp_output_t *out)
+{
+    ngx_http_webp_gif_t g;
+    WebPAnimEncoderOptions options;
+    WebPAnimEncoder *enc = NULL;
+    WebPConfig config;
+    WebPPicture picture;
+    WebPData webp;
+    uint64_t start;
+    int rc, timestamp, delay;
+
+    start = ngx_http_webp_codec_usec();
+    rc = ngx_http_webp_gif_open(&g, data, size);
+    out->decode_usec += ngx_http_webp_codec_usec() - start;
+
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+        goto done;
+    }
+
+    rc = NGX_HTTP_WEBP_CODEC_ERROR;
+
+    if (!WebPAnimEncoderOptionsInit(&options) || !WebPConfigInit(&config)) {
+        goto done;
+    }
+
+    if (params->anim_kmax > 0) {
+        options.kmin = params->anim_kmin;
+        options.kmax = params->anim_kmax;
+    }
+
+    options.minimize_size = params->anim_minimize_size;
+    options.allow_mixed = params->anim_allow_mixed;
+
+    config.quality = params->quality;
+    config.method = params->method;
+
+    if (!WebPValidateConfig(&config) || !WebPPictureInit(&picture)) {
+        goto done;
+    }
+
+    picture.use_argb = 1;
+    picture.width = g.width;
+    picture.height = g.height;
+    picture.argb = g.canvas;
+    picture.argb_stride = g.width;
+
+    timestamp = 0;
+
+    for ( ;; ) {
+        start = ngx_http_webp_codec_usec();
+        rc = ngx_http_webp_gif_frame(&g);
+        out->decode_usec += ngx_http_webp_codec_usec() - start;
+
+        if (rc == NGX_HTTP_WEBP_GIF_END) {
+            break;
+        }
+
+        if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+            goto done;
+        }
+
+        start = ngx_http_webp_codec_usec();
+
+        if (enc == NULL) {
+            /* the loop count is only known after the first frame's extensions */
+            options.anim_params.loop_count = g.loop_count;
+
+            enc = WebPAnimEncoderNew(g.width, g.height, &options);
+            if (enc == NULL) {
+                rc = NGX_HTTP_WEBP_CODEC_ERROR;
+                goto done;
+            }
+        }
+
+        if (!WebPAnimEncoderAdd(enc, &picture, timestamp, &config)) {
+            rc = NGX_HTTP_WEBP_CODEC_ENCODE_FAILED;
+            goto done;
+        }
+
+        out->encode_usec += ngx_http_webp_codec_usec() - start;
+
+        /* GIF delays are in 1/100 s; like browsers, treat 0 and 1 as 100 ms */
+        delay = g.delay <= 1 ? 10 : g.delay;
+        timestamp += delay * 10;
+    }
+
+    if (enc == NULL) {
+        rc = NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+        goto done;
+    }
+
+    start = ngx_http_webp_codec_usec();
+
+    WebPDataInit(&webp);
+
+    if (!WebPAnimEncoderAdd(enc, NULL, timestamp, NULL)
+        || !WebPAnimEncoderAssemble(enc, &webp))
+    {
+        rc = NGX_HTTP_WEBP_CODEC_ENCODE_FAILED;
+        goto done;
+    }
+
+    out->encode_usec += ngx_http_webp_codec_usec() - start;
+
+    out->data = (uint8_t *) webp.bytes;
+    out->size = webp.size;
+    rc = NGX_HTTP_WEBP_CODEC_OK;
+
+done:
+    if (enc != NULL) {
+        WebPAnimEncoderDelete(enc);
+    }
+
+    ngx_http_webp_gif_close(&g);
+
+    return rc;
+}
+
+#endif
+
+int
+ngx_http_webp_codec_decode(ngx_http_webp_format_e format, const uint8_t *data, size_t size, ngx_http_webp_image_t *img)
+{
+    memset(img, 0, sizeof(ngx_http_webp_image_t));
+
+    switch (format) {
+    case NGX_HTTP_WEBP_FORMAT_JPEG:
+        return ngx_http_webp_decode_jpeg(data, size, img);
+    case NGX_HTTP_WEBP_FORMAT_PNG:
+        return ngx_http_webp_decode_png(data, size, img);
+    case NGX_HTTP_WEBP_FORMAT_AVIF:
+        return ngx_http_webp_decode_avif(data, size, img);
+#ifdef NGX_HTTP_WEBP_JXL_ENABLED
+    case NGX_HTTP_WEBP_FORMAT_JXL:
+        return ngx_http_webp_decode_jxl(data, size, img);
+#endif
+#ifdef NGX_HTTP_WEBP_GIF_ENABLED
+    case NGX_HTTP_WEBP_FORMAT_GIF:
+        return ngx_http_webp_decode_gif(data, size, img);
+#endif
+    default:
+        return NGX_HTTP_WEBP_CODEC_DECODE_FAILED;
+    }
+}
+
+/*
+ * Whether every alpha byte is 0xff.  Each row is ANDed together 16 bytes
+ * at a time and checked at its end, so most translucent images are
+ * rejected within their first rows.
+ */
+static int
+ngx_http_webp_opaque(const ngx_http_webp_image_t *img)
+{
+    const uint8_t *row;
+    uint8_t alpha;
+    int x, y;
+#if defined(__SSE2__)
+    __m128i mask, acc;
+
+    mask = _mm_set1_epi32((int) 0xff000000);
+#endif
+
+    for (y = 0; y < img->height; y++) {
+        row = img->rgba + (size_t) y * img->stride;
+        x = 0;
+
+#if defined(__SSE2__)
+        acc = _mm_set1_epi8((char) 0xff);
+
+        for ( /* void */ ; x + 4 <= img->width; x += 4) {
+            acc = _mm_and_si128(acc, _mm_loadu_si128((const __m128i *) (row + x * 4)));
+        }
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(acc, mask), mask)) != 0xffff) {
+            return 0;
+        }
+#endif
+
+        for (alpha = 0xff; x < img->width; x++) {
+            alpha &= row[x * 4 + 3];
+        }
+
+        if (alpha != 0xff) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* an opaque image is imported as RGBX, so the encoder gets no alpha plane */
+static int
+ngx_http_webp_encode_picture(const ngx_http_webp_image_t *img, int opaque, const WebPConfig *config,
+    WebPWriterFunction writer, void *custom)
+{
+    WebPPicture picture;
+    int ok;
+
+    if (!WebPValidateConfig(config) || !WebPPictureInit(&picture)) {
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    picture.width = img->width;
+    picture.height = img->height;
+
+    ok = opaque ? WebPPictureImportRGBX(&picture, img->rgba, img->stride)
+                : WebPPictureImportRGBA(&picture, img->rgba, img->stride);
+
+    if (!ok) {
+        WebPPictureFree(&picture);
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    picture.writer = writer;
+    picture.custom_ptr = custom;
+
+    ok = WebPEncode(config, &picture);
+    WebPPictureFree(&picture);
+
+    return ok ? NGX_HTTP_WEBP_CODEC_OK : NGX_HTTP_WEBP_CODEC_ENCODE_FAILED;
+}
+
+static int
+ngx_http_webp_encode_memory(const ngx_http_webp_image_t *img, int opaque, const WebPConfig *config,
+    uint8_t **out, size_t *out_size)
+{
+    WebPMemoryWriter writer;
+    int rc;
+
+    WebPMemoryWriterInit(&writer);
+
+    rc = ngx_http_webp_encode_picture(img, opaque, config, WebPMemoryWrite, &writer);
+
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+        WebPMemoryWriterClear(&writer);
+        return rc;
+    }
+
+    *out = writer.mem;
+    *out_size = writer.size;
+
+    return NGX_HTTP_WEBP_CODEC_OK;
+}
+
+static int
+ngx_http_webp_write_all(int fd, const uint8_t *data, size_t size)
+{
+    ssize_t n;
+    size_t done;
+
+    for (done = 0; done < size; done += n) {
+        n = write(fd, data + done, size - done);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+
+            return NGX_HTTP_WEBP_CODEC_ERROR;
+        }
+    }
+
+    return NGX_HTTP_WEBP_CODEC_OK;
+}
+
+/* creates "<path>.XXXXXX", the file is renamed over "path" once complete */
+static int
+ngx_http_webp_open_temp(const char *path, char *tmp, size_t size)
+{
+    int fd, len;
+
+    len = snprintf(tmp, size, "%s.XXXXXX", path);
+    if (len < 0 || (size_t) len >= size) {
+        return -1;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fchmod(fd, 0644) == -1) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* decodes an encoded candidate and compares it with the source, in dB */
+static int
+ngx_http_webp_distortion(WebPPicture *ref, const uint8_t *data, size_t size, int target, float *db)
+{
+    WebPPicture picture;
+    float result[5];
+    uint8_t *rgba;
+    int width, height, ok;
+
+    rgba = WebPDecodeRGBA(data, size, &width, &height);
+    if (rgba == NULL) {
+        return 0;
+    }
+
+    ok = WebPPictureInit(&picture);
+
+    if (ok) {
+        picture.use_argb = 1;
+        picture.width = width;
+        picture.height = height;
+
+        ok = WebPPictureImportRGBA(&picture, rgba, width * 4)
+             && WebPPictureDistortion(ref, &picture, target == NGX_HTTP_WEBP_TARGET_SSIM ? 1 : 0, result);
+
+        WebPPictureFree(&picture);
+    }
+
+    WebPFree(rgba);
+
+    if (ok) {
+        *db = result[4];
+    }
+
+    return ok;
+}
+
+static int
+ngx_http_webp_search(const ngx_http_webp_image_t *img, int opaque, WebPConfig *config,
+    const ngx_http_webp_params_t *params, ngx_http_webp_output_t *out)
+{
+    WebPPicture ref;
+    uint8_t *data;
+    size_t size;
+    uint64_t start;
+    double target;
+    float db;
+    int lo, hi, q, rc, met;
+
+    start = ngx_http_webp_codec_usec();
+
+    if (!WebPPictureInit(&ref)) {
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    ref.use_argb = 1;
+    ref.width = img->width;
+    ref.height = img->height;
+
+    if (!WebPPictureImportRGBA(&ref, img->rgba, img->stride)) {
+        WebPPictureFree(&ref);
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    /* WebPPictureDistortion() reports SSIM in dB as well */
+
+    target = (params->target == NGX_HTTP_WEBP_TARGET_SSIM)
+             ? -10.0 * log10(1.0 - params->target_value) : params->target_value;
+
+    lo = params->target_min_quality;
+    hi = params->quality;
+
+    /* the ceiling goes first: if even that misses the target, it is the answer */
+
+    q = hi;
+    rc = NGX_HTTP_WEBP_CODEC_OK;
+
+    while (out->passes == 0 || out->passes < params->target_passes) {
+        config->quality = q;
+
+        rc = ngx_http_webp_encode_memory(img, opaque, config, &data, &size);
+        if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+            break;
+        }
+
+        out->passes++;
+
+        met = ngx_http_webp_distortion(&ref, data, size, params->target, &db) && db >= target;
+
+        if (met || out->data == NULL) {
+            WebPFree(out->data);
+            out->data = data;
+            out->size = size;
+            out->quality = q;
+
+        } else {
+            WebPFree(data);
+        }
+
+        if (!met && q == params->quality) {
+            break;
+        }
+
+        if (met) {
+            hi = q - 1;
+
+        } else {
+            lo = q + 1;
+        }
+
+        if (lo > hi
+            || (params->target_budget_usec
+                && ngx_http_webp_codec_usec() - start >= params->target_budget_usec))
+        {
+            break;
+        }
+
+        q = lo + (hi - lo) / 2;
+    }
+
+    WebPPictureFree(&ref);
+
+    /* an encoder error after the first pass still leaves a usable result */
+
+    return out->data != NULL ? NGX_HTTP_WEBP_CODEC_OK : rc;
+}
+
+static int
+ngx_http_webp_encode_setup(const ngx_http_webp_image_t *img, const ngx_http_webp_params_t *params,
+    WebPConfig *config, int *opaque, ngx_http_webp_output_t *out)
+{
+    if (!WebPConfigInit(config)) {
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    config->quality = params->quality;
+    config->method = params->method;
+
+    /* most PNG and AVIF sources carry an alpha channel that is all 0xff */
+
+    *opaque = img->opaque || ngx_http_webp_opaque(img);
+
+    out->quality = params->quality;
+    out->passes = 1;
+
+    if (params->target == NGX_HTTP_WEBP_TARGET_SIZE) {
+        /*
+         * libwebp searches the quantizer itself, config.quality is only its
+         * start, and the quality it settles on is not reported back
+         */
+        config->target_size = (int) params->target_value;
+        config->pass = params->target_passes > 0 ? params->target_passes : 1;
+        out->quality = -1;
+        out->passes = config->pass;
+    }
+
+    return NGX_HTTP_WEBP_CODEC_OK;
+}
+
+int
+ngx_http_webp_codec_encode(const ngx_http_webp_image_t *img, const ngx_http_webp_params_t *params,
+    ngx_http_webp_output_t *out)
+{
+    WebPConfig config;
+    int opaque, rc;
+
+    rc = ngx_http_webp_encode_setup(img, params, &config, &opaque, out);
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+        return rc;
+    }
+
+    if (params->target == NGX_HTTP_WEBP_TARGET_SSIM || params->target == NGX_HTTP_WEBP_TARGET_PSNR) {
+        out->passes = 0;
+        return ngx_http_webp_search(img, opaque, &config, params, out);
+    }
+
+    return ngx_http_webp_encode_memory(img, opaque, &config, &out->data, &out->size);
+}
+
+int
+ngx_http_webp_codec_convert(ngx_http_webp_format_e format, const uint8_t *data, size_t size, const ngx_http_webp_params_t *params, ngx_http_webp_output_t *out)
+{
+    ngx_http_webp_image_t img;
+    uint64_t start;
+    int rc;
+
+    memset(out, 0, sizeof(ngx_http_webp_output_t));
+
+    out->quality = params->quality;
+
+#ifdef NGX_HTTP_WEBP_GIF_ENABLED
+    if (format == NGX_HTTP_WEBP_FORMAT_GIF) {
+        return ngx_http_webp_convert_gif(data, size, params, out);
+    }
+#endif
+
+    start = ngx_http_webp_codec_usec();
+    rc = ngx_http_webp_codec_decode(format, data, size, &img);
+    out->decode_usec = ngx_http_webp_codec_usec() - start;
+
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+        return rc;
+    }
+
+    start = ngx_http_webp_codec_usec();
+    rc = ngx_http_webp_codec_encode(&img, params, out);
+    out->encode_usec = ngx_http_webp_codec_usec() - start;
+
+    ngx_http_webp_codec_free_image(&img);
+
+    return rc;
+}
+
+/*
+ * Writer for ngx_http_webp_codec_convert_file(): output stays in memory up
+ * to "spill" bytes and goes to a temporary file from then on.  The memory
+ * writer comes first, WebPMemoryWrite() expects it at picture->custom_ptr.
+ */
+typedef struct {
+    WebPMemoryWriter memory;
+    const char *path;
+    char tmp[4096];
+    int fd;
+    size_t size;
+    size_t spill;
+    size_t limit;
+    int rc;
+} ngx_http_webp_spill_t;
+
+static int
+ngx_http_webp_spill_write(const uint8_t *data, size_t data_size, const WebPPicture *picture)
+{
+    ngx_http_webp_spill_t *s = picture->custom_ptr;
+
+    s->size += data_size;
+
+    if (s->limit && s->size >= s->limit) {
+        s->rc = NGX_HTTP_WEBP_CODEC_NOT_SMALLER;
+        return 0;
+    }
+
+    if (s->fd == -1) {
+        if (s->size <= s->spill) {
+            return WebPMemoryWrite(data, data_size, picture);
+        }
+
+        s->fd = ngx_http_webp_open_temp(s->path, s->tmp, sizeof(s->tmp));
+
+        if (s->fd == -1
+            || ngx_http_webp_write_all(s->fd, s->memory.mem, s->memory.size) != NGX_HTTP_WEBP_CODEC_OK)
+        {
+            s->rc = NGX_HTTP_WEBP_CODEC_ERROR;
+            return 0;
+        }
+
+        WebPMemoryWriterClear(&s->memory);
+    }
+
+    if (ngx_http_webp_write_all(s->fd, data, data_size) != NGX_HTTP_WEBP_CODEC_OK) {
+        s->rc = NGX_HTTP_WEBP_CODEC_ERROR;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* hands over what the spill writer produced, or discards it after an error */
+static int
+ngx_http_webp_spill_finish(ngx_http_webp_spill_t *s, int rc, ngx_http_webp_output_t *out)
+{
+    out->size = s->size;
+
+    if (s->fd == -1) {
+        if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+            WebPMemoryWriterClear(&s->memory);
+            return rc;
+        }
+
+        out->data = s->memory.mem;
+        return NGX_HTTP_WEBP_CODEC_OK;
+    }
+
+    if (rc == NGX_HTTP_WEBP_CODEC_OK) {
+        if (close(s->fd) == 0 && rename(s->tmp, s->path) == 0) {
+            return NGX_HTTP_WEBP_CODEC_OK;
+        }
+
+        rc = NGX_HTTP_WEBP_CODEC_ERROR;
+
+    } else {
+        close(s->fd);
+    }
+
+    unlink(s->tmp);
+
+    return rc;
+}
+
+/*
+ * Like ngx_http_webp_codec_convert(), but output larger than "spill" bytes
+ * is written by the encoder straight into a temporary file that replaces
+ * "path" on success, so it never sits in memory as a whole; out->data is
+ * NULL then.  Smaller output is returned in out->data and nothing is
+ * written.  Output reaching "limit" bytes (0 for no limit) is abandoned as
+ * soon as the encoder emits it, with NGX_HTTP_WEBP_CODEC_NOT_SMALLER.
+ *
+ * Quality searches and animations compare or assemble complete encodes in
+ * memory, their result is written out afterwards.
+ */
+int
+ngx_http_webp_codec_convert_file(ngx_http_webp_format_e format, const uint8_t *data, size_t size,
+    const ngx_http_webp_params_t *params, const char *path, size_t limit, size_t spill,
+    ngx_http_webp_output_t *out)
+{
+    ngx_http_webp_spill_t s;
+    ngx_http_webp_image_t img;
+    WebPConfig config;
+    uint64_t start;
+    int opaque, rc;
+
+    if (format == NGX_HTTP_WEBP_FORMAT_GIF
+        || params->target == NGX_HTTP_WEBP_TARGET_SSIM
+        || params->target == NGX_HTTP_WEBP_TARGET_PSNR)
+    {
+        rc = ngx_http_webp_codec_convert(format, data, size, params, out);
+
+        if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+            return rc;
+        }
+
+        if (limit && out->size >= limit) {
+            WebPFree(out->data);
+            out->data = NULL;
+            return NGX_HTTP_WEBP_CODEC_NOT_SMALLER;
+        }
+
+        if (out->size <= spill) {
+            return NGX_HTTP_WEBP_CODEC_OK;
+        }
+
+        rc = ngx_http_webp_codec_write_file(path, out->data, out->size);
+
+        WebPFree(out->data);
+        out->data = NULL;
+
+        return rc;
+    }
+
+    memset(out, 0, sizeof(ngx_http_webp_output_t));
+
+    out->quality = params->quality;
+
+    start = ngx_http_webp_codec_usec();
+    rc = ngx_http_webp_codec_decode(format, data, size, &img);
+    out->decode_usec = ngx_http_webp_codec_usec() - start;
+
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+        return rc;
+    }
+
+    start = ngx_http_webp_codec_usec();
+
+    rc = ngx_http_webp_encode_setup(&img, params, &config, &opaque, out);
+
+    if (rc == NGX_HTTP_WEBP_CODEC_OK) {
+        memset(&s, 0, sizeof(ngx_http_webp_spill_t));
+        WebPMemoryWriterInit(&s.memory);
+
+        s.path = path;
+        s.fd = -1;
+        s.spill = spill;
+        s.limit = limit;
+        s.rc = NGX_HTTP_WEBP_CODEC_OK;
+
+        rc = ngx_http_webp_encode_picture(&img, opaque, &config, ngx_http_webp_spill_write, &s);
+
+        /* a writer failure surfaces as an encoder error, report its cause */
+
+        if (rc != NGX_HTTP_WEBP_CODEC_OK && s.rc != NGX_HTTP_WEBP_CODEC_OK) {
+            rc = s.rc;
+        }
+
+        rc = ngx_http_webp_spill_finish(&s, rc, out);
+    }
+
+    out->encode_usec = ngx_http_webp_codec_usec() - start;
+
+    ngx_http_webp_codec_free_image(&img);
+
+    return rc;
+}
+
+void
+ngx_http_webp_codec_free_image(ngx_http_webp_image_t *img)
+{
+    free(img->rgba);
+    img->rgba = NULL;
+}
+
+void
+ngx_http_webp_codec_free_output(ngx_http_webp_output_t *out)
+{
+    WebPFree(out->data);
+    out->data = NULL;
+    out->size = 0;
+}
+
+size_t
+ngx_http_webp_codec_key_material(char *buf, size_t size, const char *uri, size_t uri_len,
+    const ngx_http_webp_params_t *params)
+{
+    size_t len;
+    int n;
+
+    n = snprintf(buf, size, "%.*s|q%d", (int) uri_len, uri, params->quality);
+
+    if (n < 0 || (size_t) n >= size) {
+        return 0;
+    }
+
+    len = n;
+
+    /* defaults add nothing, so keys of plain configurations stay stable */
+
+    if (params->method != NGX_HTTP_WEBP_DEFAULT_METHOD) {
+        n = snprintf(buf + len, size - len, "|m%d", params->method);
+
+        if (n < 0 || (size_t) n >= size - len) {
+            return 0;
+        }
+
+        len += n;
+    }
+
+    if (params->target != NGX_HTTP_WEBP_TARGET_NONE) {
+        n = snprintf(buf + len, size - len, "|t%d:%.4f:%d:%d:%llu",
+                     params->target, params->target_value, params->target_min_quality,
+                     params->target_passes, (unsigned long long) params->target_budget_usec);
+
+        if (n < 0 || (size_t) n >= size - len) {
+            return 0;
+        }
+
+        len += n;
+    }
+
+    if (params->anim_kmin || params->anim_kmax || params->anim_minimize_size || params->anim_allow_mixed) {
+        n = snprintf(buf + len, size - len, "|a%d:%d:%d:%d",
+                     params->anim_kmin, params->anim_kmax,
+                     params->anim_minimize_size, params->anim_allow_mixed);
+
+        if (n < 0 || (size_t) n >= size - len) {
+            return 0;
+        }
+
+        len += n;
+    }
+
+    return len;
+}
+
+void
+ngx_http_webp_codec_key_hex(const uint8_t *digest, char *key)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < NGX_HTTP_WEBP_DIGEST_LEN; i++) {
+        key[i * 2] = hex[digest[i] >> 4];
+        key[i * 2 + 1] = hex[digest[i] & 0xf];
+    }
+}
+
+size_t
+ngx_http_webp_codec_cache_path(char *buf, size_t size, const char *dir, size_t dir_len, const char *key)
+{
+    int n;
+
+    n = snprintf(buf, size, "%.*s/%.*s" NGX_HTTP_WEBP_CACHE_SUFFIX,
+                 (int) dir_len, dir, NGX_HTTP_WEBP_KEY_LEN, key);
+
+    if (n < 0 || (size_t) n >= size) {
+        return 0;
+    }
+
+    return n;
+}
+
+/*
+ * Writes to a temporary sibling and renames it into place so readers never
+ * see a partially written variant.
+ */
+int
+ngx_http_webp_codec_write_file(const char *path, const uint8_t *data, size_t size)
+{
+    char tmp[4096];
+    int fd;
+
+    fd = ngx_http_webp_open_temp(path, tmp, sizeof(tmp));
+    if (fd == -1) {
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    if (ngx_http_webp_write_all(fd, data, size) != NGX_HTTP_WEBP_CODEC_OK) {
+        close(fd);
+        unlink(tmp);
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    if (close(fd) == -1 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return NGX_HTTP_WEBP_CODEC_ERROR;
+    }
+
+    return NGX_HTTP_WEBP_CODEC_OK;
+}
@@ -0,0 +1,109 @@
+#ifndef _NGX_HTTP_WEBP_CODEC_H_INCLUDED_
+#define _NGX_HTTP_WEBP_CODEC_H_INCLUDED_
+
+/*
+ * Decode/encode core shared by the module and the standalone tools.
+ * This file and ngx_http_webp_codec.c must not include nginx headers.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NGX_HTTP_WEBP_CODEC_OK              0
+#define NGX_HTTP_WEBP_CODEC_ERROR          -1
+#define NGX_HTTP_WEBP_CODEC_DECODE_FAILED  -2
+#define NGX_HTTP_WEBP_CODEC_ENCODE_FAILED  -3
+#define NGX_HTTP_WEBP_CODEC_NOT_SMALLER    -4
+
+/* SHA-1 of the key material, hex encoded */
+#define NGX_HTTP_WEBP_DIGEST_LEN            20
+#define NGX_HTTP_WEBP_KEY_LEN               (NGX_HTTP_WEBP_DIGEST_LEN * 2)
+#define NGX_HTTP_WEBP_CACHE_SUFFIX          ".webp"
+
+#define NGX_HTTP_WEBP_DEFAULT_METHOD        4
+
+typedef enum {
+    NGX_HTTP_WEBP_FORMAT_UNKNOWN = 0,
+    NGX_HTTP_WEBP_FORMAT_JPEG,
+    NGX_HTTP_WEBP_FORMAT_PNG,
+    NGX_HTTP_WEBP_FORMAT_AVIF,
+    NGX_HTTP_WEBP_FORMAT_JXL,
+    NGX_HTTP_WEBP_FORMAT_GIF
+} ngx_http_webp_format_e;
+
+/* opaque is set by decoders whose header rules out any transparency */
+typedef struct {
+    uint8_t *rgba;
+    int width;
+    int height;
+    int stride;
+    int opaque;
+} ngx_http_webp_image_t;
+
+#define NGX_HTTP_WEBP_TARGET_NONE           0
+#define NGX_HTTP_WEBP_TARGET_SSIM           1
+#define NGX_HTTP_WEBP_TARGET_PSNR           2
+#define NGX_HTTP_WEBP_TARGET_SIZE           3
+
+/*
+ * anim_* only apply to animated sources, 0 keeps the libwebp default.
+ *
+ * With an SSIM or PSNR target, "quality" is the ceiling of a binary search
+ * for the lowest quality down to target_min_quality whose output still
+ * meets target_value (SSIM in 0..1, PSNR in dB).  The search stops after
+ * target_passes encodes or target_budget_usec, whichever comes first, and
+ * keeps the best output found so far.  A size target (bytes) is handed to
+ * libwebp's own search, bounded by target_passes.
+ */
+typedef struct {
+    int quality;
+    int method;
+    int anim_kmin;
+    int anim_kmax;
+    int anim_minimize_size;
+    int anim_allow_mixed;
+    int target;
+    double target_value;
+    int target_min_quality;
+    int target_passes;
+    uint64_t target_budget_usec;
+} ngx_http_webp_params_t;
+
+/*
+ * quality is the one the output was encoded at, -1 when libwebp picked it
+ * for a size target; passes is the number of encodes it took
+ */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    int quality;
+    int passes;
+    uint64_t decode_usec;
+    uint64_t encode_usec;
+} ngx_http_webp_output_t;
+
+ngx_http_webp_format_e ngx_http_webp_codec_format(const char *path, size_t len);
+int ngx_http_webp_codec_decode(ngx_http_webp_format_e format, const uint8_t *data, size_t size, ngx_http_webp_image_t *img);
+int ngx_http_webp_codec_encode(const ngx_http_webp_image_t *img, const ngx_http_webp_params_t *params, ngx_http_webp_output_t *out);
+int ngx_http_webp_codec_convert(ngx_http_webp_format_e format, const uint8_t *data, size_t size, const ngx_http_webp_params_t *params, ngx_http_webp_output_t *out);
+int ngx_http_webp_codec_convert_file(ngx_http_webp_format_e format, const uint8_t *data, size_t size, const ngx_http_webp_params_t *params, const char *path, size_t limit, size_t spill, ngx_http_webp_output_t *out);
+void ngx_http_webp_codec_free_image(ngx_http_webp_image_t *img);
+void ngx_http_webp_codec_free_output(ngx_http_webp_output_t *out);
+
+/*
+ * Cache key scheme: the key is the hex SHA-1 of "<uri>|q<quality>",
+ * followed by "|m<method>", "|t<target>:..." and "|a<anim>:..." for every
+ * group of encoding parameters that is not at its default, and the variant
+ * lives at "<cache_dir>/<key>.webp".  Hashing is left to the caller
+ * (ngx_sha1 in the module, OpenSSL in the tools) so the core stays free of
+ * any crypto dependency; both produce the same digest.
+ * NGX_HTTP_WEBP_KEY_MATERIAL_LEN bounds the material beyond the URI.
+ */
+#define NGX_HTTP_WEBP_KEY_MATERIAL_LEN      192
+
+size_t ngx_http_webp_codec_key_material(char *buf, size_t size, const char *uri, size_t uri_len, const ngx_http_webp_params_t *params);
+void ngx_http_webp_codec_key_hex(const uint8_t *digest, char *key);
+size_t ngx_http_webp_codec_cache_path(char *buf, size_t size, const char *dir, size_t dir_len, const char *key);
+int ngx_http_webp_codec_write_file(const char *path, const uint8_t *data, size_t size);
+
+#endif /* _NGX_HTTP_WEBP_CODEC_H_INCLUDED_ */
@@ -1,121 +1,238 @@
 #include "ngx_http_webp_module.h"
 
+static ngx_str_t ngx_http_webp_thread_pool_name = ngx_string("default");
+
+/* encoding parameters of a location, shared by the cache key and the encoder */
+void
+ngx_http_webp_params(ngx_http_webp_loc_conf_t *conf, ngx_uint_t quality, ngx_http_webp_params_t *params)
+{
+    params->quality = quality;
+    params->method = NGX_HTTP_WEBP_DEFAULT_METHOD;
+    params->anim_kmin = conf->anim_kmin;
+    params->anim_kmax = conf->anim_kmax;
+    params->anim_minimize_size = conf->anim_minimize_size;
+    params->anim_allow_mixed = conf->anim_allow_mixed;
+
+    params->target = conf->target;
+    params->target_value = (conf->target == NGX_HTTP_WEBP_TARGET_SSIM) ? conf->target_value / 10000.0
+                           : (conf->target == NGX_HTTP_WEBP_TARGET_PSNR) ? conf->target_value / 100.0
+                           : (double) conf->target_value;
+    params->target_min_quality = conf->target_min;
+    params->target_passes = conf->target_passes;
+    params->target_budget_usec = (uint64_t) conf->target_budget * 1000;
+}
+
 static void
 ngx_http_webp_convert_thread_handler(void *data, ngx_log_t *log)
 {
     ngx_http_webp_convert_ctx_t *ctx = data;
-    uint8_t *raw_data = NULL;
-    int width, height;
-    uint8_t *webp_data = NULL;
-    size_t webp_size;
-
-    if (ngx_strstr(ctx->src_path.data, ".png")) {
-        raw_data = WebPDecodeRGBA(ctx->image_data, ctx->image_size, &width, &height);
-    } else if (ngx_strstr(ctx->src_path.data, ".jpg") || ngx_strstr(ctx->src_path.data, ".jpeg")) {
-        raw_data = WebPDecodeRGBA(ctx->image_data, ctx->image_size, &width, &height);
-    } else if (ngx_strstr(ctx->src_path.data, ".avif")) {
-        avifDecoder *decoder = avifDecoderCreate();
-        avifResult result = avifDecoderSetIOMemory(decoder, ctx->image_data, ctx->image_size);
-        if (result == AVIF_RESULT_OK) {
-            result = avifDecoderParse(decoder);
-            if (result == AVIF_RESULT_OK) {
-                avifRGBImage rgb;
-                avifRGBImageSetDefaults(&rgb, decoder->image);
-                rgb.format = AVIF_RGB_FORMAT_RGBA;
-                rgb.depth = 8;
-                raw_data = ngx_palloc(ctx->pool, rgb.rowBytes * rgb.height);
-                rgb.pixels = raw_data;
-                result = avifImageYUVToRGB(decoder->image, &rgb);
-                if (result == AVIF_RESULT_OK) {
-                    width = rgb.width;
-                    height = rgb.height;
-                }
-            }
-        }
-        avifDecoderDestroy(decoder);
-    }
-#ifdef NGX_HTTP_WEBP_JXL_ENABLED
-    else if (ngx_strstr(ctx->src_path.data, ".jxl")) {
-        JxlDecoder *decoder = JxlDecoderCreate(NULL);
-        JxlBasicInfo info;
-        JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
-        JxlDecoderSetInput(decoder, ctx->image_data, ctx->image_size);
-        if (JxlDecoderGetBasicInfo(decoder, &info) == JXL_DEC_SUCCESS) {
-            size_t buffer_size = info.xsize * info.ysize * 4;
-            raw_data = ngx_palloc(ctx->pool, buffer_size);
-            JxlDecoderSetImageOutBuffer(decoder, &format, raw_data, buffer_size);
-            JxlDecoderProcessInput(decoder);
-            width = info.xsize;
-            height = info.ysize;
-        }
-        JxlDecoderDestroy(decoder);
-    }
-#endif
+    ngx_http_webp_loc_conf_t *conf;
+    ngx_http_webp_params_t params;
+    ngx_http_webp_output_t out;
+    uint64_t start;
+    size_t spill;
+    int rc;
+
+    conf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_webp_module);
+
+    ngx_http_webp_params(conf, ctx->quality, &params);
 
-    if (raw_data == NULL) {
+    /*
+     * Output that may go into a segment is kept in memory, anything larger
+     * is written to the cache file by the encoder as it is produced.  The
+     * limit abandons output that is not smaller than the original: such a
+     * variant is never handed out.
+     */
+
+    spill = (conf->segment_size && conf->cache_zone != NULL) ? conf->segment_max_object : 0;
+
+    rc = ngx_http_webp_codec_convert_file(ctx->format, ctx->image_data, ctx->image_size, &params,
+                                          (char *) ctx->dst_path.data, ctx->image_size, spill, &out);
+
+    ctx->decode_usec = out.decode_usec;
+    ctx->encode_usec = out.encode_usec;
+
+    ngx_http_webp_stats_observe(ctx->stats, NGX_HTTP_WEBP_STAGE_DECODE, out.decode_usec);
+
+    if (rc == NGX_HTTP_WEBP_CODEC_DECODE_FAILED) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "Failed to decode image: %V", &ctx->src_path);
+        ctx->state = NGX_HTTP_WEBP_STATE_DECODE_FAILED;
         ctx->result = NGX_ERROR;
         return;
     }
 
-    webp_size = WebPEncodeRGBA(raw_data, width, height, width * 4, ctx->quality, &webp_data);
-    if (raw_data != ctx->image_data) {
-        ngx_pfree(ctx->pool, raw_data);
+    if (rc == NGX_HTTP_WEBP_CODEC_NOT_SMALLER) {
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+                      "WebP output not smaller than the original, keeping it: %V (%uz >= %uz)",
+                      &ctx->src_path, out.size, ctx->image_size);
+        ctx->state = NGX_HTTP_WEBP_STATE_ORIGINAL_BETTER;
+        ctx->result = NGX_DECLINED;
+        return;
     }
 
-    if (webp_data == NULL) {
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "Failed to encode WebP image: %V", &ctx->src_path);
         ctx->result = NGX_ERROR;
         return;
     }
 
-    ctx->webp_data = webp_data;
-    ctx->webp_size = webp_size;
+    ngx_http_webp_stats_observe(ctx->stats, NGX_HTTP_WEBP_STAGE_ENCODE, out.encode_usec);
+
+    if (conf->target != NGX_HTTP_WEBP_TARGET_NONE) {
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "webp quality target: q%d after %d passes for %V",
+                       out.quality, out.passes, &ctx->src_path);
+    }
+
+    /* the quality actually used goes into the index and the validators */
+
+    ctx->encoded_quality = (out.quality >= 0) ? (ngx_uint_t) out.quality : NGX_HTTP_WEBP_QUALITY_UNKNOWN;
+    ctx->webp_size = out.size;
+
+    if (out.data == NULL) {
+        /* already in dst_path, the write time is part of the encode stage */
+        ctx->result = NGX_OK;
+        return;
+    }
+
+    start = ngx_http_webp_usec();
+
+    /* small variants are packed into segments, the rest get a file each */
+
+    if (spill && ngx_http_webp_segment_store(ctx, conf, out.data, out.size, log) == NGX_OK) {
+        ngx_http_webp_stats_observe(ctx->stats, NGX_HTTP_WEBP_STAGE_WRITE, ngx_http_webp_usec() - start);
+        ngx_http_webp_codec_free_output(&out);
+        ctx->result = NGX_OK;
+        return;
+    }
+
+    rc = ngx_http_webp_codec_write_file((char *) ctx->dst_path.data, out.data, out.size);
+    ngx_http_webp_stats_observe(ctx->stats, NGX_HTTP_WEBP_STAGE_WRITE, ngx_http_webp_usec() - start);
+    ngx_http_webp_codec_free_output(&out);
+
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "Failed to write WebP file: %V", &ctx->dst_path);
+        ctx->result = NGX_ERROR;
+        return;
+    }
+
     ctx->result = NGX_OK;
 }
 
+/*
+ * Conversion failed: resume the phase engine after this handler so the
+ * original image is served by the next content handler.
+ */
+static void
+ngx_http_webp_decline(ngx_http_request_t *r)
+{
+    r->phase_handler++;
+    r->write_event_handler = ngx_http_core_run_phases;
+    ngx_http_core_run_phases(r);
+}
+
+/*
+ * Accounts for a conversion that produced no variant and remembers the
+ * reason in the index when it is not a transient one.
+ */
+void
+ngx_http_webp_record_outcome(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
+{
+    if (ctx->state == NGX_HTTP_WEBP_STATE_ORIGINAL_BETTER) {
+        ngx_http_webp_stats_add(ctx->stats, original_better, 1);
+
+    } else if (ctx->state != NGX_HTTP_WEBP_STATE_TOO_LARGE) {
+        ngx_http_webp_stats_add(ctx->stats, failures, 1);
+    }
+
+    if (ctx->state != NGX_HTTP_WEBP_STATE_OK && ngx_http_webp_store_cache(r, ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "Failed to index negative entry for %V", &r->uri);
+    }
+}
+
+static void
+ngx_http_webp_convert_event_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t *r = ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_webp_convert_ctx_t *ctx;
+    ngx_int_t rc;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_webp_module);
+
+    ngx_http_webp_stats_add(ctx->stats, queue_depth, (ngx_atomic_int_t) -1);
+
+    if (ctx->result != NGX_OK) {
+        ngx_http_webp_record_outcome(r, ctx);
+        ngx_http_webp_decline(r);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    ngx_http_webp_stats_add(ctx->stats, conversions, 1);
+    ngx_http_webp_stats_add(ctx->stats, bytes_in, ctx->image_size);
+    ngx_http_webp_stats_add(ctx->stats, bytes_out, ctx->webp_size);
+
+    if (ngx_http_webp_store_cache(r, ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "Failed to index WebP file: %V", &ctx->dst_path);
+    }
+
+    rc = ngx_http_webp_serve_file(r, ctx->segment ? &ctx->segment_path : &ctx->dst_path);
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
 ngx_int_t
-ngx_http_webp_convert_image(ngx_http_request_t *r, ngx_str_t *src_path, ngx_str_t *dst_path)
+ngx_http_webp_convert_image(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
 {
     ngx_http_webp_loc_conf_t *conf;
-    ngx_http_webp_convert_ctx_t *ctx;
-    ngx_thread_task_t *task;
-    ngx_thread_pool_t *tp;
     ngx_file_t file;
+    uint64_t start;
     size_t size;
     ssize_t n;
 
     conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
 
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_webp_convert_ctx_t));
-    if (ctx == NULL) {
-        return NGX_ERROR;
-    }
+    start = ngx_http_webp_usec();
 
-    file.name = *src_path;
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = ctx->src_path;
     file.log = r->connection->log;
-    file.fd = ngx_open_file(src_path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    file.fd = ngx_open_file(ctx->src_path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
     if (file.fd == NGX_INVALID_FILE) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "Failed to open image file: %V", src_path);
-        return NGX_ERROR;
+                      "Failed to open image file: %V", &ctx->src_path);
+        return NGX_DECLINED;
     }
 
-    if (ngx_file_info(file.name.data, &file.info) == NGX_FILE_ERROR) {
+    if (ngx_fd_info(file.fd, &file.info) == NGX_FILE_ERROR) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "Failed to stat file: %V", src_path);
+                      "Failed to stat file: %V", &ctx->src_path);
         ngx_close_file(file.fd);
         return NGX_ERROR;
     }
 
     size = ngx_file_size(&file.info);
     if (size > conf->max_image_size) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                       "Image file too large: %V, size: %uz, max allowed: %uz",
-                      src_path, size, conf->max_image_size);
+                      &ctx->src_path, size, conf->max_image_size);
         ngx_close_file(file.fd);
-        return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+
+        ctx->image_size = size;
+        ctx->source_mtime = ngx_file_mtime(&file.info);
+        ctx->state = NGX_HTTP_WEBP_STATE_TOO_LARGE;
+        ngx_http_webp_record_outcome(r, ctx);
+
+        return NGX_DECLINED;
     }
 
     ctx->image_data = ngx_pnalloc(r->pool, size);
@@ -127,30 +244,63 @@ ngx_http_webp_convert_image(ngx_http_request_t *r, ngx_str_t *src_path, ngx_str_
     n = ngx_read_file(&file, ctx->image_data, size, 0);
     ngx_close_file(file.fd);
 
-    if (n == NGX_ERROR) {
+    if (n == NGX_ERROR || (size_t) n != size) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "Failed to read image file: %V", src_path);
+                      "Failed to read image file: %V", &ctx->src_path);
         return NGX_ERROR;
     }
 
-    ctx->src_path = *src_path;
-    ctx->dst_path = *dst_path;
+    ngx_http_webp_stats_observe(ctx->stats, NGX_HTTP_WEBP_STAGE_READ, ngx_http_webp_usec() - start);
+
     ctx->image_size = size;
-    ctx->quality = conf->quality;
-    ctx->pool = r->pool;
+    ctx->source_mtime = ngx_file_mtime(&file.info);
+
+    if (ngx_http_webp_post_conversion(r, ctx, ngx_http_webp_convert_event_handler) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main->count++;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    return NGX_DONE;
+}
+
+/*
+ * Queues the conversion of ctx->image_data in the thread pool; the request
+ * is blocked until "handler" runs on completion.
+ */
+ngx_int_t
+ngx_http_webp_post_conversion(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx,
+    ngx_event_handler_pt handler)
+{
+    ngx_http_webp_loc_conf_t *conf;
+    ngx_thread_task_t *task;
+    ngx_thread_pool_t *tp;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
 
-    task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_webp_convert_ctx_t));
+    /* the thread handler must not touch the request pool */
+
+    ctx->segment = 0;
+
+    if (conf->segment_size && ngx_http_webp_segment_path(r, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    task = ngx_thread_task_alloc(r->pool, 0);
     if (task == NULL) {
         return NGX_ERROR;
     }
 
     task->handler = ngx_http_webp_convert_thread_handler;
     task->ctx = ctx;
+    task->event.handler = handler;
+    task->event.data = r;
 
-    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, NULL);
+    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_http_webp_thread_pool_name);
     if (tp == NULL) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "Failed to get thread pool");
+                      "Failed to get thread pool \"%V\"", &ngx_http_webp_thread_pool_name);
         return NGX_ERROR;
     }
 
@@ -158,16 +308,20 @@ ngx_http_webp_convert_image(ngx_http_request_t *r, ngx_str_t *src_path, ngx_str_
         return NGX_ERROR;
     }
 
+    ngx_http_webp_stats_add(ctx->stats, queue_depth, 1);
+
     r->main->blocked++;
     r->aio = 1;
 
-    return NGX_AGAIN;
+    return NGX_OK;
 }
 
 ngx_int_t
 ngx_http_webp_serve_file(ngx_http_request_t *r, ngx_str_t *path)
 {
+    ngx_http_webp_convert_ctx_t *ctx;
     ngx_int_t rc;
+    off_t offset, size;
     ngx_buf_t *b;
     ngx_chain_t out;
     ngx_open_file_info_t of;
@@ -205,18 +359,51 @@ ngx_http_webp_serve_file(ngx_http_request_t *r, ngx_str_t *path)
         return NGX_DECLINED;
     }
 
-    r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = of.size;
-    r->headers_out.last_modified_time = of.mtime;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_webp_module);
 
-    if (ngx_http_set_etag(r) != NGX_OK) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    /*
+     * A packed variant is a range of its segment, the index knows which.
+     * Segments only grow, so of.size may predate the variant when it comes
+     * from the open file cache and is not checked against.
+     */
+
+    offset = 0;
+    size = of.size;
+
+    if (ctx != NULL) {
+        ctx->served = 1;
+
+        if (ctx->segment) {
+            offset = ctx->offset;
+            size = ctx->webp_size;
+        }
+
+        ctx->webp_size = (size_t) size;
     }
 
-    if (ngx_http_set_content_type(r) != NGX_OK) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = size;
+
+    if (ctx != NULL && ctx->source_mtime) {
+        if (ngx_http_webp_set_validators(r, ctx) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+    } else if (ctx != NULL && ctx->segment) {
+        /* the segment's own size and mtime say nothing about the variant */
+        r->headers_out.last_modified_time = -1;
+
+    } else {
+        r->headers_out.last_modified_time = of.mtime;
+
+        if (ngx_http_set_etag(r) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
+    ngx_str_set(&r->headers_out.content_type, "image/webp");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
     b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
     if (b == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -233,10 +420,10 @@ ngx_http_webp_serve_file(ngx_http_request_t *r, ngx_str_t *path)
         return rc;
     }
 
-    b->file_pos = 0;
-    b->file_last = of.size;
+    b->file_pos = offset;
+    b->file_last = offset + size;
 
-    b->in_file = b->file_last ? 1 : 0;
+    b->in_file = size ? 1 : 0;
     b->last_buf = (r == r->main) ? 1 : 0;
     b->last_in_chain = 1;
 
@@ -249,4 +436,159 @@ ngx_http_webp_serve_file(ngx_http_request_t *r, ngx_str_t *path)
     out.next = NULL;
 
     return ngx_http_output_filter(r, &out);
-}
\ No newline at end of file
+}
+/*
+ * Validators are derived from the source fingerprint and the encoding
+ * parameters rather than from the cache file, so they stay the same across
+ * re-conversions and can be produced from the index without a stat().  The
+ * cache key stands in for the parameters, it hashes all of them.
+ */
+ngx_int_t
+ngx_http_webp_set_validators(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
+{
+    ngx_table_elt_t *etag;
+    u_char *p;
+
+    r->headers_out.last_modified_time = ctx->source_mtime;
+
+    etag = ngx_list_push(&r->headers_out.headers);
+    if (etag == NULL) {
+        return NGX_ERROR;
+    }
+
+    etag->hash = 1;
+#if (nginx_version >= 1023000)
+    etag->next = NULL;
+#endif
+    ngx_str_set(&etag->key, "ETag");
+
+    etag->value.data = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + NGX_OFF_T_LEN + NGX_INT_T_LEN
+                                            + NGX_HTTP_WEBP_ETAG_KEY_LEN + 8);
+    if (etag->value.data == NULL) {
+        etag->hash = 0;
+        return NGX_ERROR;
+    }
+
+    p = ngx_sprintf(etag->value.data, "\"%xT-%xO-%*s",
+                    ctx->source_mtime, (off_t) ctx->image_size,
+                    (size_t) NGX_HTTP_WEBP_ETAG_KEY_LEN, ctx->cache_key.data);
+
+    if (ctx->encoded_quality != NGX_HTTP_WEBP_QUALITY_UNKNOWN) {
+        p = ngx_sprintf(p, "-q%ui", ctx->encoded_quality);
+    }
+
+    *p++ = '"';
+
+    etag->value.len = p - etag->value.data;
+
+    r->headers_out.etag = etag;
+
+    return NGX_OK;
+}
+
+/* If-None-Match list matching, weak comparison as RFC 7232 requires */
+static ngx_uint_t
+ngx_http_webp_etag_match(ngx_table_elt_t *header, ngx_str_t *etag)
+{
+    u_char *start, *end;
+
+    start = header->value.data;
+    end = start + header->value.len;
+
+    if (header->value.len == 1 && *start == '*') {
+        return 1;
+    }
+
+    while (start < end) {
+
+        if (end - start > 2 && start[0] == 'W' && start[1] == '/') {
+            start += 2;
+        }
+
+        if ((size_t) (end - start) >= etag->len
+            && ngx_strncmp(start, etag->data, etag->len) == 0)
+        {
+            start += etag->len;
+
+            while (start < end && (*start == ' ' || *start == '\t')) {
+                start++;
+            }
+
+            if (start == end || *start == ',') {
+                return 1;
+            }
+        }
+
+        while (start < end && *start != ',') {
+            start++;
+        }
+
+        while (start < end && (*start == ' ' || *start == '\t' || *start == ',')) {
+            start++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Answers a conditional GET for an indexed variant with 304 using only the
+ * data copied out of the index; NGX_DECLINED means the body must be sent.
+ */
+ngx_int_t
+ngx_http_webp_not_modified(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
+{
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_uint_t match;
+    time_t ims;
+
+    if (ctx->source_mtime == 0
+        || (r->headers_in.if_none_match == NULL && r->headers_in.if_modified_since == NULL))
+    {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_webp_set_validators(r, ctx) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (r->headers_in.if_none_match) {
+        match = ngx_http_webp_etag_match(r->headers_in.if_none_match, &r->headers_out.etag->value);
+
+    } else {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        ims = ngx_parse_http_time(r->headers_in.if_modified_since->value.data,
+                                  r->headers_in.if_modified_since->value.len);
+
+        switch (clcf->if_modified_since) {
+        case NGX_HTTP_IMS_EXACT:
+            match = (ims == ctx->source_mtime);
+            break;
+        case NGX_HTTP_IMS_BEFORE:
+            match = (ims != NGX_ERROR && ims >= ctx->source_mtime);
+            break;
+        default:
+            match = 0;
+            break;
+        }
+    }
+
+    if (!match) {
+        /* serve_file() sets the validators again */
+        r->headers_out.etag->hash = 0;
+        r->headers_out.etag = NULL;
+        r->headers_out.last_modified_time = -1;
+        return NGX_DECLINED;
+    }
+
+    ctx->served = 1;
+
+    r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+    r->header_only = 1;
+
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+
+    return ngx_http_send_header(r);
+}
@@ -0,0 +1,586 @@
+#include "ngx_http_webp_module.h"
+
+/*
+ * Filter mode: images produced by other content handlers (proxy_pass,
+ * fastcgi, ...) are buffered, converted in the thread pool and indexed
+ * under the same keys as local files.
+ */
+
+#define NGX_HTTP_WEBP_FILTER_READ     1
+#define NGX_HTTP_WEBP_FILTER_PROCESS  2
+#define NGX_HTTP_WEBP_FILTER_SEND     3
+#define NGX_HTTP_WEBP_FILTER_PASS     4
+#define NGX_HTTP_WEBP_FILTER_HIT      5
+#define NGX_HTTP_WEBP_FILTER_DONE     6
+
+/* same bit as the image filter, the two never convert the same response */
+#define NGX_HTTP_WEBP_BUFFERED        0x08
+
+#define NGX_HTTP_WEBP_FILTER_BUFFER   65536
+
+typedef struct {
+    ngx_str_t type;
+    ngx_http_webp_format_e format;
+} ngx_http_webp_filter_type_t;
+
+static ngx_http_webp_filter_type_t ngx_http_webp_filter_types[] = {
+    { ngx_string("image/jpeg"), NGX_HTTP_WEBP_FORMAT_JPEG },
+    { ngx_string("image/pjpeg"), NGX_HTTP_WEBP_FORMAT_JPEG },
+    { ngx_string("image/png"), NGX_HTTP_WEBP_FORMAT_PNG },
+    { ngx_string("image/avif"), NGX_HTTP_WEBP_FORMAT_AVIF },
+#if (NGX_HTTP_WEBP_JXL_ENABLED)
+    { ngx_string("image/jxl"), NGX_HTTP_WEBP_FORMAT_JXL },
+#endif
+#if (NGX_HTTP_WEBP_GIF_ENABLED)
+    { ngx_string("image/gif"), NGX_HTTP_WEBP_FORMAT_GIF },
+#endif
+    { ngx_null_string, NGX_HTTP_WEBP_FORMAT_UNKNOWN }
+};
+
+static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt ngx_http_next_body_filter;
+
+static ngx_http_webp_format_e
+ngx_http_webp_filter_format(ngx_str_t *content_type)
+{
+    ngx_http_webp_filter_type_t *t;
+
+    for (t = ngx_http_webp_filter_types; t->type.len; t++) {
+        if (content_type->len >= t->type.len
+            && ngx_strncasecmp(content_type->data, t->type.data, t->type.len) == 0
+            && (content_type->len == t->type.len
+                || content_type->data[t->type.len] == ';'
+                || content_type->data[t->type.len] == ' '))
+        {
+            return t->format;
+        }
+    }
+
+    return NGX_HTTP_WEBP_FORMAT_UNKNOWN;
+}
+
+/*
+ * The origin's validators stand in for the source fingerprint, as they did
+ * when the entry was stored: a changed Last-Modified or Content-Length
+ * means a changed image.  Either is only compared when the origin sends it.
+ */
+static ngx_uint_t
+ngx_http_webp_filter_fresh(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
+{
+    time_t mtime;
+
+    mtime = r->headers_out.last_modified_time > 0 ? r->headers_out.last_modified_time : 0;
+
+    if (mtime != ctx->source_mtime) {
+        return 0;
+    }
+
+    if (r->headers_out.content_length_n >= 0
+        && r->headers_out.content_length_n != (off_t) ctx->image_size)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Opens the indexed variant and switches the response headers over to it.
+ * Returns a file buffer ready to be sent, or NULL if the file is gone.
+ */
+static ngx_buf_t *
+ngx_http_webp_filter_file(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
+{
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_open_file_info_t of;
+    ngx_str_t *path;
+    off_t offset, size;
+    ngx_buf_t *b;
+
+    if (ctx->segment) {
+        if (ngx_http_webp_segment_path(r, ctx) != NGX_OK) {
+            return NULL;
+        }
+
+        path = &ctx->segment_path;
+
+    } else {
+        path = &ctx->dst_path;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.read_ahead = clcf->read_ahead;
+    of.directio = clcf->directio;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, path, &of, r->pool) != NGX_OK
+        || !of.is_file)
+    {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, of.err,
+                      "Failed to open WebP file: %V", path);
+        return NULL;
+    }
+
+    /* of.size of a segment may be older than the variant, see serve_file() */
+
+    if (ctx->segment) {
+        offset = ctx->offset;
+        size = ctx->webp_size;
+
+    } else {
+        offset = 0;
+        size = of.size;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NULL;
+    }
+
+    ngx_http_clear_etag(r);
+    ngx_http_clear_accept_ranges(r);
+
+    if (ctx->source_mtime && ngx_http_webp_set_validators(r, ctx) != NGX_OK) {
+        return NULL;
+    }
+
+    ctx->served = 1;
+    ctx->webp_size = (size_t) size;
+
+    r->headers_out.content_length_n = size;
+
+    if (r->headers_out.content_length) {
+        r->headers_out.content_length->hash = 0;
+        r->headers_out.content_length = NULL;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "image/webp");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    b->file_pos = offset;
+    b->file_last = offset + size;
+
+    b->in_file = size ? 1 : 0;
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+
+    b->file->fd = of.fd;
+    b->file->name = *path;
+    b->file->log = r->connection->log;
+    b->file->directio = of.is_directio;
+
+    return b;
+}
+
+static ngx_int_t
+ngx_http_webp_header_filter(ngx_http_request_t *r)
+{
+    ngx_http_webp_loc_conf_t *conf;
+    ngx_http_webp_convert_ctx_t *ctx;
+    ngx_http_webp_format_e format;
+    ngx_uint_t quality;
+    ngx_str_t uri;
+    ngx_int_t rc;
+    u_char *p;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+
+    /* a context means the content handler has already dealt with the request */
+
+    if (!conf->filter
+        || r != r->main
+        || !(r->method & NGX_HTTP_GET)
+        || r->headers_out.status != NGX_HTTP_OK
+        || ngx_http_get_module_ctx(r, ngx_http_webp_module) != NULL)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    format = ngx_http_webp_filter_format(&r->headers_out.content_type);
+
+    if (format == NGX_HTTP_WEBP_FORMAT_UNKNOWN
+        || (r->headers_out.content_encoding && r->headers_out.content_encoding->value.len)
+        || !ngx_http_webp_accepts_webp(r))
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_webp_convert_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->format = format;
+    ctx->request = r;
+    ctx->stats = ngx_http_webp_stats(r);
+    ctx->src_path = r->uri;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_webp_module);
+
+    /* without validators a changed image could not be told from a cached one */
+
+    if (r->headers_out.last_modified_time <= 0 && r->headers_out.content_length_n < 0) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    if (ngx_http_webp_quality(r, conf, &quality) != NGX_OK) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ctx->quality = quality;
+
+    /* the origin may answer differently for every query string */
+
+    uri = r->uri;
+
+    if (r->args.len) {
+        uri.len = r->uri.len + 1 + r->args.len;
+
+        uri.data = ngx_pnalloc(r->pool, uri.len);
+        if (uri.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        p = ngx_cpymem(uri.data, r->uri.data, r->uri.len);
+        *p++ = '?';
+        ngx_memcpy(p, r->args.data, r->args.len);
+    }
+
+    if (ngx_http_webp_cache_key(r, &uri, ctx->quality, &ctx->cache_key, &ctx->dst_path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_webp_lookup_cache(r, ctx);
+
+    if ((rc == NGX_OK || rc == NGX_DONE) && !ngx_http_webp_filter_fresh(r, ctx)) {
+        ngx_http_webp_invalidate_cache(r, ctx);
+        rc = NGX_DECLINED;
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_http_webp_stats_add(ctx->stats, negative_hits, 1);
+        return ngx_http_next_header_filter(r);
+    }
+
+    if (rc == NGX_OK) {
+        ctx->file = ngx_http_webp_filter_file(r, ctx);
+
+        if (ctx->file != NULL) {
+            ngx_http_webp_stats_add(ctx->stats, hits, 1);
+            ctx->filter = NGX_HTTP_WEBP_FILTER_HIT;
+            return ngx_http_next_header_filter(r);
+        }
+
+        /* the file is gone, the entry must not send the next request here */
+
+        ngx_http_webp_invalidate_cache(r, ctx);
+    }
+
+    /* the origin's Last-Modified stands in for the source mtime */
+
+    ctx->source_mtime = r->headers_out.last_modified_time > 0
+                        ? r->headers_out.last_modified_time : 0;
+
+    if (r->headers_out.content_length_n > (off_t) conf->max_image_size) {
+        ctx->image_size = r->headers_out.content_length_n;
+        ctx->state = NGX_HTTP_WEBP_STATE_TOO_LARGE;
+        ctx->cache_status = NGX_HTTP_WEBP_CACHE_BYPASS;
+        ngx_http_webp_record_outcome(r, ctx);
+        return ngx_http_next_header_filter(r);
+    }
+
+    ngx_http_webp_stats_add(ctx->stats, misses, 1);
+
+    ctx->filter = NGX_HTTP_WEBP_FILTER_READ;
+
+    r->main_filter_need_in_memory = 1;
+    r->allow_ranges = 0;
+
+    /* the header is sent once the body has been converted or given up on */
+
+    return NGX_OK;
+}
+
+/*
+ * Appends the chain to the image buffer.  Returns NGX_OK once the last
+ * buffer has been seen, NGX_AGAIN if more is expected and NGX_DECLINED if
+ * the image outgrew webp_max_image_size, with *rest set to the first link
+ * that was not consumed.
+ */
+static ngx_int_t
+ngx_http_webp_filter_read(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx, ngx_chain_t *in,
+    ngx_chain_t **rest)
+{
+    ngx_http_webp_loc_conf_t *conf;
+    ngx_buf_t *b;
+    u_char *p;
+    size_t size, alloc;
+    ssize_t n;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+        size = ngx_buf_size(b);
+
+        if (ctx->image_size + size > conf->max_image_size) {
+            *rest = in;
+            return NGX_DECLINED;
+        }
+
+        if (ctx->image_size + size > ctx->image_alloc) {
+            alloc = r->headers_out.content_length_n > 0
+                    ? (size_t) r->headers_out.content_length_n
+                    : ngx_max(ctx->image_alloc * 2, NGX_HTTP_WEBP_FILTER_BUFFER);
+
+            alloc = ngx_min(ngx_max(alloc, ctx->image_size + size), conf->max_image_size);
+
+            p = ngx_pnalloc(r->pool, alloc);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            if (ctx->image_size) {
+                ngx_memcpy(p, ctx->image_data, ctx->image_size);
+            }
+
+            ctx->image_data = p;
+            ctx->image_alloc = alloc;
+        }
+
+        if (ngx_buf_in_memory(b)) {
+            ngx_memcpy(ctx->image_data + ctx->image_size, b->pos, size);
+            b->pos = b->last;
+
+        } else if (size) {
+            n = ngx_read_file(b->file, ctx->image_data + ctx->image_size, size, b->file_pos);
+            if (n != (ssize_t) size) {
+                return NGX_ERROR;
+            }
+
+            b->file_pos = b->file_last;
+        }
+
+        ctx->image_size += size;
+
+        if (b->last_buf) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_AGAIN;
+}
+
+/* sends the original response: the buffered part, then whatever follows */
+static ngx_int_t
+ngx_http_webp_filter_pass(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx, ngx_chain_t *rest)
+{
+    ngx_chain_t out;
+    ngx_buf_t *b;
+    ngx_int_t rc;
+
+    /* from here on the response passes through untouched */
+
+    ctx->filter = 0;
+
+    rc = ngx_http_next_header_filter(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    if (ctx->image_size == 0) {
+        return ngx_http_next_body_filter(r, rest);
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = ctx->image_data;
+    b->last = ctx->image_data + ctx->image_size;
+    b->memory = 1;
+    b->last_buf = (rest == NULL);
+    b->last_in_chain = (rest == NULL);
+
+    out.buf = b;
+    out.next = rest;
+
+    return ngx_http_next_body_filter(r, &out);
+}
+
+static void
+ngx_http_webp_filter_discard(ngx_chain_t *in)
+{
+    for ( /* void */ ; in; in = in->next) {
+        in->buf->pos = in->buf->last;
+        in->buf->file_pos = in->buf->file_last;
+    }
+}
+
+static void
+ngx_http_webp_filter_event_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t *r = ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_webp_convert_ctx_t *ctx;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_webp_module);
+
+    ngx_http_webp_stats_add(ctx->stats, queue_depth, (ngx_atomic_int_t) -1);
+
+    if (ctx->result == NGX_OK) {
+        ngx_http_webp_stats_add(ctx->stats, conversions, 1);
+        ngx_http_webp_stats_add(ctx->stats, bytes_in, ctx->image_size);
+        ngx_http_webp_stats_add(ctx->stats, bytes_out, ctx->webp_size);
+
+        if (ngx_http_webp_store_cache(r, ctx) != NGX_OK) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "Failed to index WebP file: %V", &ctx->dst_path);
+        }
+
+        ctx->filter = NGX_HTTP_WEBP_FILTER_SEND;
+
+    } else {
+        ngx_http_webp_record_outcome(r, ctx);
+        ctx->filter = NGX_HTTP_WEBP_FILTER_PASS;
+    }
+
+    /* let the write handler pull the result through the body filter */
+
+    if (r->done) {
+        c->write->handler(c->write);
+
+    } else {
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+static ngx_int_t
+ngx_http_webp_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_http_webp_convert_ctx_t *ctx;
+    ngx_chain_t out, *rest;
+    ngx_int_t rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_webp_module);
+
+    if (ctx == NULL || ctx->filter == 0) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    switch (ctx->filter) {
+
+    case NGX_HTTP_WEBP_FILTER_READ:
+
+        rest = NULL;
+        rc = ngx_http_webp_filter_read(r, ctx, in, &rest);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_OK;
+        }
+
+        if (rc == NGX_DECLINED) {
+            NGX_HTTP_WEBP_LOG(NGX_LOG_INFO, r->connection->log, 0,
+                              "Upstream image too large, passing through: %V", &r->uri);
+            ctx->cache_status = NGX_HTTP_WEBP_CACHE_BYPASS;
+            ctx->state = NGX_HTTP_WEBP_STATE_TOO_LARGE;
+            ngx_http_webp_record_outcome(r, ctx);
+            return ngx_http_webp_filter_pass(r, ctx, rest);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_webp_post_conversion(r, ctx, ngx_http_webp_filter_event_handler) != NGX_OK) {
+            return ngx_http_webp_filter_pass(r, ctx, NULL);
+        }
+
+        ctx->filter = NGX_HTTP_WEBP_FILTER_PROCESS;
+        r->buffered |= NGX_HTTP_WEBP_BUFFERED;
+
+        return NGX_AGAIN;
+
+    case NGX_HTTP_WEBP_FILTER_PROCESS:
+        return NGX_AGAIN;
+
+    case NGX_HTTP_WEBP_FILTER_SEND:
+
+        r->buffered &= ~NGX_HTTP_WEBP_BUFFERED;
+
+        out.buf = ngx_http_webp_filter_file(r, ctx);
+
+        if (out.buf == NULL) {
+            return ngx_http_webp_filter_pass(r, ctx, NULL);
+        }
+
+        ctx->filter = NGX_HTTP_WEBP_FILTER_DONE;
+
+        rc = ngx_http_next_header_filter(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+
+        out.next = NULL;
+
+        return ngx_http_next_body_filter(r, &out);
+
+    case NGX_HTTP_WEBP_FILTER_PASS:
+
+        r->buffered &= ~NGX_HTTP_WEBP_BUFFERED;
+
+        return ngx_http_webp_filter_pass(r, ctx, NULL);
+
+    case NGX_HTTP_WEBP_FILTER_HIT:
+
+        /* the indexed variant replaces the origin body */
+
+        ngx_http_webp_filter_discard(in);
+
+        ctx->filter = NGX_HTTP_WEBP_FILTER_DONE;
+
+        out.buf = ctx->file;
+        out.next = NULL;
+
+        ctx->file = NULL;
+
+        return ngx_http_next_body_filter(r, &out);
+
+    default: /* NGX_HTTP_WEBP_FILTER_DONE */
+
+        ngx_http_webp_filter_discard(in);
+
+        return NGX_OK;
+    }
+}
+
+ngx_int_t
+ngx_http_webp_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_webp_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_webp_body_filter;
+
+    return NGX_OK;
+}
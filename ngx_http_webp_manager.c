@@ -0,0 +1,652 @@
+#include "ngx_http_webp_module.h"
+
+/*
+ * Cache maintenance runs in nginx's cache manager and cache loader
+ * processes rather than in the workers.  Every cache directory in use is
+ * registered as an ngx_path_t, the same way proxy_cache_path does it:
+ *
+ *   the manager expires and evicts index entries from the tail of the LRU
+ *   queue, deleting their files, until the indexed variants fit into
+ *   webp_max_cache_size, and compacts segments; a directory without a zone
+ *   is swept instead, expiring variants by mtime and evicting the oldest
+ *   ones until the rest fit;
+ *
+ *   the loader walks the directory once after startup and indexes the
+ *   variants the zone does not know about yet, such as those of a previous
+ *   instance or copied in from ngx_webp_batch, and removes what cannot be
+ *   used: temporary files left behind by a crash and segments of another
+ *   zone.
+ */
+
+/* longest the manager sleeps when there is nothing to do */
+#define NGX_HTTP_WEBP_MANAGER_IDLE 10000
+
+/* files younger than this may still be about to be indexed */
+#define NGX_HTTP_WEBP_LOADER_GRACE 60
+
+/* how often a directory without a zone is swept */
+#define NGX_HTTP_WEBP_SWEEP_INTERVAL 60000
+
+typedef struct {
+    time_t mtime;
+    off_t size;
+    u_char key[NGX_HTTP_WEBP_KEY_LEN];
+} ngx_http_webp_sweep_item_t;
+
+typedef struct {
+    ngx_http_webp_cache_dir_t *dir;
+    ngx_array_t items;
+    off_t total;
+} ngx_http_webp_sweep_t;
+
+static ngx_msec_t ngx_http_webp_cache_manager(void *data);
+static ngx_msec_t ngx_http_webp_cache_sweep(ngx_http_webp_cache_dir_t *dir);
+static ngx_int_t ngx_http_webp_cache_sweep_file(ngx_tree_ctx_t *ctx, ngx_str_t *path);
+static ngx_int_t ngx_http_webp_cache_sweep_cmp(const void *one, const void *two);
+static ngx_uint_t ngx_http_webp_cache_is_variant(u_char *name, size_t len);
+static void ngx_http_webp_cache_throttle(ngx_http_webp_cache_dir_t *dir, ngx_uint_t files,
+    ngx_http_webp_cache_worker_conf_t *wc);
+static void ngx_http_webp_cache_loader(void *data);
+static ngx_int_t ngx_http_webp_cache_load_file(ngx_tree_ctx_t *ctx, ngx_str_t *path);
+static ngx_int_t ngx_http_webp_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path);
+
+/*
+ * webp_cache_manager [files=number] [sleep=time] [threshold=time];
+ * webp_cache_loader [files=number] [sleep=time] [threshold=time];
+ */
+char *
+ngx_http_webp_cache_worker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_webp_cache_worker_conf_t *wc;
+    ngx_str_t *value, s;
+    ngx_msec_t *msp;
+    ngx_uint_t i;
+    ngx_int_t n;
+
+    wc = (ngx_http_webp_cache_worker_conf_t *) ((char *) conf + cmd->offset);
+
+    if (wc->sleep != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    wc->sleep = 50;
+    wc->threshold = 200;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "files=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            wc->files = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sleep=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+            msp = &wc->sleep;
+
+        } else if (ngx_strncmp(value[i].data, "threshold=", 10) == 0) {
+            s.len = value[i].len - 10;
+            s.data = value[i].data + 10;
+            msp = &wc->threshold;
+
+        } else {
+            goto invalid;
+        }
+
+        *msp = ngx_parse_time(&s, 0);
+        if (*msp == (ngx_msec_t) NGX_ERROR || *msp == 0) {
+            goto invalid;
+        }
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/*
+ * Registers the cache directory of a location with the cache manager.
+ * Locations sharing a directory share its entry; the limits of the first
+ * one win, and the zone of the first one that has a zone.  Index keys do
+ * not include the directory, so a zone can serve only one directory.
+ */
+ngx_int_t
+ngx_http_webp_add_cache_dir(ngx_conf_t *cf, ngx_http_webp_loc_conf_t *conf)
+{
+    ngx_http_webp_main_conf_t *wmcf;
+    ngx_http_webp_cache_dir_t **dirs, *dir;
+    ngx_uint_t i, found;
+
+    wmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_webp_module);
+
+    dirs = wmcf->dirs.elts;
+
+    found = 0;
+
+    for (i = 0; i < wmcf->dirs.nelts; i++) {
+        if (dirs[i]->path->name.len != conf->cache_dir.len
+            || ngx_strncmp(dirs[i]->path->name.data, conf->cache_dir.data, conf->cache_dir.len) != 0)
+        {
+            if (conf->cache_zone != NULL && dirs[i]->zone == conf->cache_zone) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "cache zone \"%V\" is already used by \"%V\"",
+                                   &conf->cache_zone->shm.name, &dirs[i]->path->name);
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if (dirs[i]->zone == NULL) {
+            dirs[i]->zone = conf->cache_zone;
+            dirs[i]->segment_size = conf->segment_size;
+            dirs[i]->valid = conf->cache_time;
+
+        } else if (conf->cache_zone != NULL && dirs[i]->zone != conf->cache_zone) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"%V\" is already used with cache zone \"%V\"",
+                               &conf->cache_dir, &dirs[i]->zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        found = 1;
+    }
+
+    if (found) {
+        return NGX_OK;
+    }
+
+    dir = ngx_pcalloc(cf->pool, sizeof(ngx_http_webp_cache_dir_t));
+    if (dir == NULL) {
+        return NGX_ERROR;
+    }
+
+    dir->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+    if (dir->path == NULL) {
+        return NGX_ERROR;
+    }
+
+    dir->zone = conf->cache_zone;
+    dir->max_size = conf->max_cache_size;
+    dir->segment_size = conf->segment_size;
+    dir->valid = conf->cache_time;
+    dir->files = wmcf->manager.files ? wmcf->manager.files : conf->files_per_cleanup;
+    dir->main = wmcf;
+
+    dir->path->name = conf->cache_dir;
+    dir->path->manager = ngx_http_webp_cache_manager;
+    dir->path->loader = ngx_http_webp_cache_loader;
+    dir->path->data = dir;
+    dir->path->conf_file = cf->conf_file->file.name.data;
+    dir->path->line = cf->conf_file->line;
+
+    if (ngx_add_path(cf, &dir->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    dirs = ngx_array_push(&wmcf->dirs);
+    if (dirs == NULL) {
+        return NGX_ERROR;
+    }
+
+    *dirs = dir;
+
+    return NGX_OK;
+}
+
+/*
+ * Returns the directory whose variants a zone indexes, or NULL if no
+ * converting location uses the zone.
+ */
+ngx_str_t *
+ngx_http_webp_zone_cache_dir(ngx_http_request_t *r, ngx_shm_zone_t *zone)
+{
+    ngx_http_webp_main_conf_t *wmcf;
+    ngx_http_webp_cache_dir_t **dirs;
+    ngx_uint_t i;
+
+    wmcf = ngx_http_get_module_main_conf(r, ngx_http_webp_module);
+
+    dirs = wmcf->dirs.elts;
+
+    for (i = 0; i < wmcf->dirs.nelts; i++) {
+        if (dirs[i]->zone == zone) {
+            return &dirs[i]->path->name;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Runs in the cache manager process.  Works through at most "files"
+ * entries or "threshold" milliseconds per call and returns how long to
+ * sleep before the next one.
+ */
+static ngx_msec_t
+ngx_http_webp_cache_manager(void *data)
+{
+    ngx_http_webp_cache_dir_t *dir = data;
+    ngx_http_webp_cache_entry_t *entry;
+    ngx_http_webp_shm_ctx_t *ctx;
+    ngx_slab_pool_t *shpool;
+    ngx_msec_t start, elapsed, next;
+    ngx_uint_t files, expired, file;
+    ngx_queue_t *q;
+    time_t wait;
+    u_char key[NGX_HTTP_WEBP_KEY_LEN];
+    u_char path[NGX_MAX_PATH];
+
+    if (dir->zone == NULL) {
+        return ngx_http_webp_cache_sweep(dir);
+    }
+
+    if (dir->zone->data == NULL) {
+        return NGX_HTTP_WEBP_MANAGER_IDLE;
+    }
+
+    ctx = dir->zone->data;
+    shpool = (ngx_slab_pool_t *) dir->zone->shm.addr;
+
+    next = NGX_HTTP_WEBP_MANAGER_IDLE;
+    start = ngx_current_msec;
+    files = 0;
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&shpool->mutex);
+
+        if (ngx_queue_empty(&ctx->queue)) {
+            ngx_shmtx_unlock(&shpool->mutex);
+            break;
+        }
+
+        q = ngx_queue_last(&ctx->queue);
+        entry = ngx_queue_data(q, ngx_http_webp_cache_entry_t, queue);
+
+        wait = entry->expire - ngx_time();
+        expired = (wait < 0);
+
+        if (!expired && ctx->size <= dir->max_size) {
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            if (wait < NGX_HTTP_WEBP_MANAGER_IDLE / 1000) {
+                next = (ngx_msec_t) (wait + 1) * 1000;
+            }
+
+            break;
+        }
+
+        /* negative entries and packed variants have no file of their own */
+
+        file = (entry->state == NGX_HTTP_WEBP_STATE_OK && entry->segment == 0);
+        ngx_memcpy(key, entry->key, NGX_HTTP_WEBP_KEY_LEN);
+
+        ngx_http_webp_cache_delete_locked(ctx, shpool, entry);
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        if (expired) {
+            ngx_http_webp_stats_add(&ctx->stats, expired, 1);
+
+        } else {
+            ngx_http_webp_stats_add(&ctx->stats, evictions, 1);
+        }
+
+        if (file
+            && ngx_http_webp_codec_cache_path((char *) path, sizeof(path),
+                                              (char *) dir->path->name.data, dir->path->name.len,
+                                              (char *) key) != 0
+            && ngx_delete_file(path) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                              "Failed to delete cache file: %s", path);
+        }
+
+        if (++files >= dir->files) {
+            next = dir->main->manager.sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - start));
+
+        if (elapsed >= dir->main->manager.threshold) {
+            next = dir->main->manager.sleep;
+            break;
+        }
+    }
+
+    if (dir->segment_size) {
+        (void) ngx_http_webp_segment_compact(dir->zone, &dir->path->name, dir->segment_size, ngx_cycle->log);
+    }
+
+    return next;
+}
+
+/*
+ * Without a zone there is no LRU order to follow: the directory is walked,
+ * variants older than webp_cache_time are deleted and, if the rest exceed
+ * webp_max_cache_size, the ones with the oldest mtime go until they fit.
+ */
+static ngx_msec_t
+ngx_http_webp_cache_sweep(ngx_http_webp_cache_dir_t *dir)
+{
+    ngx_http_webp_sweep_item_t *item;
+    ngx_http_webp_sweep_t sweep;
+    ngx_tree_ctx_t tree;
+    ngx_pool_t *pool;
+    ngx_uint_t i, removed;
+    u_char path[NGX_MAX_PATH];
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_HTTP_WEBP_SWEEP_INTERVAL;
+    }
+
+    if (ngx_array_init(&sweep.items, pool, 1024, sizeof(ngx_http_webp_sweep_item_t)) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NGX_HTTP_WEBP_SWEEP_INTERVAL;
+    }
+
+    sweep.dir = dir;
+    sweep.total = 0;
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_webp_cache_sweep_file;
+    tree.pre_tree_handler = ngx_http_webp_cache_noop;
+    tree.post_tree_handler = ngx_http_webp_cache_noop;
+    tree.spec_handler = ngx_http_webp_cache_noop;
+    tree.data = &sweep;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    dir->last = ngx_current_msec;
+    dir->loaded = 0;
+    dir->removed = 0;
+
+    if (ngx_walk_tree(&tree, &dir->path->name) == NGX_ABORT) {
+        ngx_destroy_pool(pool);
+        return NGX_HTTP_WEBP_SWEEP_INTERVAL;
+    }
+
+    removed = dir->removed;
+
+    if (sweep.total > (off_t) dir->max_size) {
+        ngx_sort(sweep.items.elts, sweep.items.nelts, sizeof(ngx_http_webp_sweep_item_t),
+                 ngx_http_webp_cache_sweep_cmp);
+
+        item = sweep.items.elts;
+
+        for (i = 0; i < sweep.items.nelts && sweep.total > (off_t) dir->max_size; i++) {
+            if (ngx_http_webp_codec_cache_path((char *) path, sizeof(path),
+                                               (char *) dir->path->name.data, dir->path->name.len,
+                                               (char *) item[i].key) == 0)
+            {
+                continue;
+            }
+
+            if (ngx_delete_file(path) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+                NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                                  "Failed to delete cache file: %s", path);
+                continue;
+            }
+
+            sweep.total -= item[i].size;
+            removed++;
+        }
+    }
+
+    ngx_destroy_pool(pool);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "webp cache sweep: \"%V\", %ui files removed", &dir->path->name, removed);
+
+    return NGX_HTTP_WEBP_SWEEP_INTERVAL;
+}
+
+static ngx_int_t
+ngx_http_webp_cache_sweep_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_webp_sweep_t *sweep = ctx->data;
+    ngx_http_webp_cache_dir_t *dir = sweep->dir;
+    ngx_http_webp_sweep_item_t *item;
+    u_char *name;
+
+    if (ngx_terminate || ngx_quit) {
+        return NGX_ABORT;
+    }
+
+    name = path->data + path->len;
+
+    while (name > path->data && name[-1] != '/') {
+        name--;
+    }
+
+    if (!ngx_http_webp_cache_is_variant(name, path->data + path->len - name)) {
+        return NGX_OK;
+    }
+
+    if (ngx_time() - ctx->mtime > dir->valid) {
+        if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+            NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, ctx->log, ngx_errno,
+                              "Failed to delete cache file: %s", path->data);
+
+        } else {
+            dir->removed++;
+        }
+
+    } else {
+        item = ngx_array_push(&sweep->items);
+
+        /* without memory for the list the file is not counted, not lost */
+
+        if (item != NULL) {
+            item->mtime = ctx->mtime;
+            item->size = ctx->size;
+            ngx_memcpy(item->key, name, NGX_HTTP_WEBP_KEY_LEN);
+            sweep->total += ctx->size;
+        }
+    }
+
+    ngx_http_webp_cache_throttle(dir, dir->files, &dir->main->manager);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_webp_cache_sweep_cmp(const void *one, const void *two)
+{
+    const ngx_http_webp_sweep_item_t *a = one, *b = two;
+
+    return (a->mtime < b->mtime) ? -1 : (a->mtime > b->mtime);
+}
+
+/* runs once in the cache loader process */
+static void
+ngx_http_webp_cache_loader(void *data)
+{
+    ngx_http_webp_cache_dir_t *dir = data;
+    ngx_tree_ctx_t tree;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "webp cache loader: \"%V\"", &dir->path->name);
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_webp_cache_load_file;
+    tree.pre_tree_handler = ngx_http_webp_cache_noop;
+    tree.post_tree_handler = ngx_http_webp_cache_noop;
+    tree.spec_handler = ngx_http_webp_cache_noop;
+    tree.data = dir;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    dir->last = ngx_current_msec;
+    dir->loaded = 0;
+    dir->indexed = 0;
+    dir->removed = 0;
+
+    if (ngx_walk_tree(&tree, &dir->path->name) == NGX_ABORT) {
+        return;
+    }
+
+    NGX_HTTP_WEBP_LOG(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "webp cache \"%V\": %ui variants indexed, %ui stale files removed",
+                      &dir->path->name, dir->indexed, dir->removed);
+}
+
+static ngx_uint_t
+ngx_http_webp_cache_is_variant(u_char *name, size_t len)
+{
+    return len == NGX_HTTP_WEBP_KEY_LEN + sizeof(NGX_HTTP_WEBP_CACHE_SUFFIX) - 1
+           && ngx_strncmp(name + NGX_HTTP_WEBP_KEY_LEN, NGX_HTTP_WEBP_CACHE_SUFFIX,
+                          sizeof(NGX_HTTP_WEBP_CACHE_SUFFIX) - 1) == 0;
+}
+
+/*
+ * "<key>.webp" files are variants, valid or not: whether one still matches
+ * its source is only known once it is requested.  The zone gets an entry
+ * for every one it does not know yet; none is ever removed here.
+ */
+static ngx_uint_t
+ngx_http_webp_cache_variant(ngx_http_webp_cache_dir_t *dir, u_char *name, size_t len, ngx_tree_ctx_t *tree)
+{
+    ngx_str_t key;
+
+    if (!ngx_http_webp_cache_is_variant(name, len)) {
+        return 0;
+    }
+
+    if (dir->zone == NULL || dir->zone->data == NULL || dir->valid == 0 || tree->size == 0) {
+        return 1;
+    }
+
+    key.len = NGX_HTTP_WEBP_KEY_LEN;
+    key.data = name;
+
+    if (ngx_http_webp_cache_add_file(dir->zone, &key, (size_t) tree->size, tree->mtime, dir->valid) == NGX_OK) {
+        dir->indexed++;
+    }
+
+    return 1;
+}
+
+/*
+ * A file is stale if it is a temporary file or a segment that no segment
+ * slot of the zone refers to.  Anything else in the directory is left
+ * alone.
+ */
+static ngx_uint_t
+ngx_http_webp_cache_stale(ngx_http_webp_cache_dir_t *dir, u_char *name, size_t len)
+{
+    ngx_http_webp_shm_ctx_t *ctx;
+    ngx_int_t generation, id;
+
+    ctx = (dir->zone != NULL) ? dir->zone->data : NULL;
+
+    /* "<generation>-<id>.seg", only the current generation can be in use */
+
+    if (len == NGX_HTTP_WEBP_SEGMENT_NAME_LEN - 2
+        && name[8] == '-'
+        && ngx_strncmp(name + 17, ".seg", 4) == 0)
+    {
+        generation = ngx_hextoi(name, 8);
+        id = ngx_hextoi(name + 9, 8);
+
+        if (generation == NGX_ERROR || id == NGX_ERROR) {
+            return 0;
+        }
+
+        if (ctx == NULL || (ngx_uint_t) generation != ctx->generation) {
+            return 1;
+        }
+
+        return ctx->segments[id % NGX_HTTP_WEBP_SEGMENTS].id != (ngx_atomic_uint_t) id;
+    }
+
+    /* "<key>.webp.XXXXXX" left by an interrupted write */
+
+    return len == NGX_HTTP_WEBP_KEY_LEN + sizeof(NGX_HTTP_WEBP_CACHE_SUFFIX) + 6
+           && ngx_strncmp(name + NGX_HTTP_WEBP_KEY_LEN, NGX_HTTP_WEBP_CACHE_SUFFIX ".",
+                          sizeof(NGX_HTTP_WEBP_CACHE_SUFFIX)) == 0;
+}
+
+static ngx_int_t
+ngx_http_webp_cache_load_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_webp_cache_dir_t *dir = ctx->data;
+    u_char *name;
+
+    if (ngx_terminate || ngx_quit) {
+        NGX_HTTP_WEBP_LOG(NGX_LOG_ALERT, ctx->log, 0, "webp cache loader exiting");
+        return NGX_ABORT;
+    }
+
+    name = path->data + path->len;
+
+    while (name > path->data && name[-1] != '/') {
+        name--;
+    }
+
+    if (ngx_time() - ctx->mtime > NGX_HTTP_WEBP_LOADER_GRACE
+        && !ngx_http_webp_cache_variant(dir, name, path->data + path->len - name, ctx)
+        && ngx_http_webp_cache_stale(dir, name, path->data + path->len - name))
+    {
+        if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+            NGX_HTTP_WEBP_LOG(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed", path->data);
+
+        } else {
+            dir->removed++;
+        }
+    }
+
+    ngx_http_webp_cache_throttle(dir, dir->main->loader.files, &dir->main->loader);
+
+    return NGX_OK;
+}
+
+/* yields the disk to the workers during a walk, like the proxy cache loader */
+static void
+ngx_http_webp_cache_throttle(ngx_http_webp_cache_dir_t *dir, ngx_uint_t files,
+    ngx_http_webp_cache_worker_conf_t *wc)
+{
+    ngx_msec_t elapsed;
+
+    if (++dir->loaded >= files) {
+        ngx_msleep(wc->sleep);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - dir->last));
+
+        if (elapsed < wc->threshold) {
+            return;
+        }
+
+        ngx_msleep(wc->sleep);
+    }
+
+    ngx_time_update();
+
+    dir->last = ngx_current_msec;
+    dir->loaded = 0;
+}
+
+static ngx_int_t
+ngx_http_webp_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
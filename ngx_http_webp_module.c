@@ -33,6 +33,14 @@ static ngx_command_t ngx_http_webp_commands[] = {
         offsetof(ngx_http_webp_loc_conf_t, cache_dir),
         NULL
     },
+    {
+        ngx_string("webp_cache_zone"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+        ngx_http_webp_cache_zone,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
     {
         ngx_string("webp_max_image_size"),
         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
@@ -49,6 +57,30 @@ static ngx_command_t ngx_http_webp_commands[] = {
         offsetof(ngx_http_webp_loc_conf_t, max_cache_size),
         NULL
     },
+    {
+        ngx_string("webp_original_better_time"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_webp_loc_conf_t, original_better_time),
+        NULL
+    },
+    {
+        ngx_string("webp_decode_failed_time"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_webp_loc_conf_t, decode_failed_time),
+        NULL
+    },
+    {
+        ngx_string("webp_too_large_time"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_webp_loc_conf_t, too_large_time),
+        NULL
+    },
     {
         ngx_string("webp_files_per_cleanup"),
         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
@@ -57,14 +89,118 @@ static ngx_command_t ngx_http_webp_commands[] = {
         offsetof(ngx_http_webp_loc_conf_t, files_per_cleanup),
         NULL
     },
+    {
+        ngx_string("webp_cache_manager"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_ANY,
+        ngx_http_webp_cache_worker,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_webp_main_conf_t, manager),
+        NULL
+    },
+    {
+        ngx_string("webp_cache_loader"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_ANY,
+        ngx_http_webp_cache_worker,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_webp_main_conf_t, loader),
+        NULL
+    },
+    {
+        ngx_string("webp_quality_target"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_webp_quality_target,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("webp_segment_size"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_webp_loc_conf_t, segment_size),
+        NULL
+    },
+    {
+        ngx_string("webp_segment_max_object"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_webp_loc_conf_t, segment_max_object),
+        NULL
+    },
+    {
+        ngx_string("webp_rate_limit"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_webp_rate_limit,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("webp_sidecar"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_webp_sidecar,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("webp_filter"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_webp_loc_conf_t, filter),
+        NULL
+    },
+    {
+        ngx_string("webp_anim_keyframes"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+        ngx_http_webp_anim_keyframes,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("webp_anim_minimize_size"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_webp_loc_conf_t, anim_minimize_size),
+        NULL
+    },
+    {
+        ngx_string("webp_anim_allow_mixed"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_webp_loc_conf_t, anim_allow_mixed),
+        NULL
+    },
+    {
+        ngx_string("webp_status"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+        ngx_http_webp_status,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("webp_purge"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+        ngx_http_webp_purge,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
     ngx_null_command
 };
 
 static ngx_http_module_t ngx_http_webp_module_ctx = {
     NULL,                          /* preconfiguration */
     ngx_http_webp_init,            /* postconfiguration */
-    NULL,                          /* create main configuration */
-    NULL,                          /* init main configuration */
+    ngx_http_webp_create_main_conf, /* create main configuration */
+    ngx_http_webp_init_main_conf,  /* init main configuration */
     NULL,                          /* create server configuration */
     NULL,                          /* merge server configuration */
     ngx_http_webp_create_loc_conf, /* create location configuration */
@@ -78,7 +214,7 @@ ngx_module_t ngx_http_webp_module = {
     NGX_HTTP_MODULE,              /* module type */
     NULL,                         /* init master */
     NULL,                         /* init module */
-    ngx_http_webp_init_process,   /* init process */
+    NULL,                         /* init process */
     NULL,                         /* init thread */
     NULL,                         /* exit thread */
     NULL,                         /* exit process */
@@ -86,6 +222,47 @@ ngx_module_t ngx_http_webp_module = {
     NGX_MODULE_V1_PADDING
 };
 
+void *
+ngx_http_webp_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_webp_main_conf_t *wmcf;
+
+    wmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_webp_main_conf_t));
+    if (wmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&wmcf->dirs, cf->pool, 4, sizeof(ngx_http_webp_cache_dir_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    /* manager.files stays 0 and falls back to webp_files_per_cleanup */
+
+    wmcf->manager.sleep = NGX_CONF_UNSET_MSEC;
+    wmcf->manager.threshold = NGX_CONF_UNSET_MSEC;
+    wmcf->loader.sleep = NGX_CONF_UNSET_MSEC;
+    wmcf->loader.threshold = NGX_CONF_UNSET_MSEC;
+
+    return wmcf;
+}
+
+char *
+ngx_http_webp_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_webp_main_conf_t *wmcf = conf;
+
+    ngx_conf_init_msec_value(wmcf->manager.sleep, 50);
+    ngx_conf_init_msec_value(wmcf->manager.threshold, 200);
+    ngx_conf_init_msec_value(wmcf->loader.sleep, 50);
+    ngx_conf_init_msec_value(wmcf->loader.threshold, 200);
+
+    if (wmcf->loader.files == 0) {
+        wmcf->loader.files = 100;
+    }
+
+    return NGX_CONF_OK;
+}
+
 void *
 ngx_http_webp_create_loc_conf(ngx_conf_t *cf)
 {
@@ -102,6 +279,20 @@ ngx_http_webp_create_loc_conf(ngx_conf_t *cf)
     conf->max_image_size = NGX_CONF_UNSET_SIZE;
     conf->max_cache_size = NGX_CONF_UNSET_SIZE;
     conf->files_per_cleanup = NGX_CONF_UNSET_UINT;
+    conf->rate_limit = NGX_CONF_UNSET_UINT;
+    conf->cache_zone = NGX_CONF_UNSET_PTR;
+    conf->sidecar = NGX_CONF_UNSET_PTR;
+    conf->filter = NGX_CONF_UNSET;
+    conf->anim_kmin = NGX_CONF_UNSET_UINT;
+    conf->anim_kmax = NGX_CONF_UNSET_UINT;
+    conf->anim_minimize_size = NGX_CONF_UNSET;
+    conf->anim_allow_mixed = NGX_CONF_UNSET;
+    conf->original_better_time = NGX_CONF_UNSET;
+    conf->decode_failed_time = NGX_CONF_UNSET;
+    conf->too_large_time = NGX_CONF_UNSET;
+    conf->segment_size = NGX_CONF_UNSET_SIZE;
+    conf->segment_max_object = NGX_CONF_UNSET_SIZE;
+    conf->target = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
@@ -119,16 +310,434 @@ ngx_http_webp_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->max_image_size, prev->max_image_size, 10 * 1024 * 1024);
     ngx_conf_merge_size_value(conf->max_cache_size, prev->max_cache_size, 1024 * 1024 * 1024);
     ngx_conf_merge_uint_value(conf->files_per_cleanup, prev->files_per_cleanup, 100);
+    ngx_conf_merge_uint_value(conf->rate_limit, prev->rate_limit, 10);
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_ptr_value(conf->sidecar, prev->sidecar, NULL);
+    ngx_conf_merge_value(conf->filter, prev->filter, 0);
+    ngx_conf_merge_value(conf->anim_minimize_size, prev->anim_minimize_size, 0);
+    ngx_conf_merge_value(conf->anim_allow_mixed, prev->anim_allow_mixed, 0);
+    ngx_conf_merge_sec_value(conf->original_better_time, prev->original_better_time, 86400);
+    ngx_conf_merge_sec_value(conf->decode_failed_time, prev->decode_failed_time, 600);
+    ngx_conf_merge_sec_value(conf->too_large_time, prev->too_large_time, 3600);
+    ngx_conf_merge_size_value(conf->segment_size, prev->segment_size, 0);
+    ngx_conf_merge_size_value(conf->segment_max_object, prev->segment_max_object, 64 * 1024);
+
+    if (conf->segment_size) {
+#if (NGX_PTR_SIZE == 4)
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"webp_segment_size\" is not supported on 32-bit platforms");
+        return NGX_CONF_ERROR;
+#else
+        if (conf->segment_size > 0xffffffff) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"webp_segment_size\" must be less than 4g");
+            return NGX_CONF_ERROR;
+        }
+
+        if (conf->segment_max_object > conf->segment_size) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"webp_segment_max_object\" must not exceed \"webp_segment_size\"");
+            return NGX_CONF_ERROR;
+        }
+#endif
+    }
+
+    if (conf->anim_kmax == NGX_CONF_UNSET_UINT) {
+        conf->anim_kmin = prev->anim_kmin;
+        conf->anim_kmax = prev->anim_kmax;
+    }
+
+    /* 0 leaves the key frame distance to libwebp */
+    ngx_conf_init_uint_value(conf->anim_kmin, 0);
+    ngx_conf_init_uint_value(conf->anim_kmax, 0);
+
+    if (conf->target == NGX_CONF_UNSET_UINT) {
+        conf->target = prev->target;
+        conf->target_value = prev->target_value;
+        conf->target_min = prev->target_min;
+        conf->target_passes = prev->target_passes;
+        conf->target_budget = prev->target_budget;
+    }
+
+    ngx_conf_init_uint_value(conf->target, NGX_HTTP_WEBP_TARGET_NONE);
+
+    if ((conf->enable || conf->filter) && ngx_http_webp_add_cache_dir(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
 
+/*
+ * webp_cache_zone name:size [max_entries=number] | name | off;
+ *
+ * Every use of a name refers to the same zone, so locations and servers
+ * can share one index.  The size has to be given at least once; uses that
+ * repeat it must agree on max_entries.
+ */
+char *
+ngx_http_webp_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_webp_loc_conf_t *wlcf = conf;
+    ngx_http_webp_zone_conf_t *zcf;
+    ngx_str_t *value, name, s;
+    ngx_uint_t max_entries;
+    ngx_int_t n;
+    ssize_t size;
+    u_char *p;
+
+    if (wlcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        wlcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    name = value[1];
+    size = 0;
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p != NULL) {
+        name.len = p - name.data;
+
+        s.data = p + 1;
+        s.len = value[1].data + value[1].len - s.data;
+
+        size = ngx_parse_size(&s);
+
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    max_entries = 0;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "max_entries=", 12) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        n = ngx_atoi(value[2].data + 12, value[2].len - 12);
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid max_entries \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (size == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"max_entries\" requires the size of zone \"%V\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        max_entries = n;
+    }
+
+    wlcf->cache_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_webp_module);
+    if (wlcf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (size == 0) {
+        return NGX_CONF_OK;
+    }
+
+    zcf = wlcf->cache_zone->data;
+
+    if (zcf != NULL) {
+        if (zcf->max_entries != max_entries) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "conflicting \"max_entries\" for zone \"%V\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    zcf = ngx_palloc(cf->pool, sizeof(ngx_http_webp_zone_conf_t));
+    if (zcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    zcf->max_entries = max_entries;
+
+    wlcf->cache_zone->init = ngx_http_webp_init_shm_zone;
+    wlcf->cache_zone->data = zcf;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * webp_rate_limit off | rate;
+ *
+ * The rate is given as "10r/s", conversions per second and worker.
+ */
+char *
+ngx_http_webp_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_webp_loc_conf_t *wlcf = conf;
+    ngx_str_t *value;
+    ngx_int_t n;
+    size_t len;
+
+    if (wlcf->rate_limit != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        wlcf->rate_limit = 0;
+        return NGX_CONF_OK;
+    }
+
+    len = value[1].len;
+
+    if (len > 3 && ngx_strncmp(value[1].data + len - 3, "r/s", 3) == 0) {
+        len -= 3;
+    }
+
+    n = ngx_atoi(value[1].data, len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rate \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    wlcf->rate_limit = n;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * webp_sidecar off | suffix ...;
+ *
+ * Suffixes are appended to the source file name and tried in order, so
+ * "webp_sidecar .webp;" serves image.jpg.webp next to image.jpg.
+ */
+char *
+ngx_http_webp_sidecar(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_webp_loc_conf_t *wlcf = conf;
+    ngx_str_t *value, *suffix;
+    ngx_uint_t i;
+
+    if (wlcf->sidecar != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        wlcf->sidecar = NULL;
+        return NGX_CONF_OK;
+    }
+
+    wlcf->sidecar = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_str_t));
+    if (wlcf->sidecar == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (value[i].len == 0 || ngx_strlchr(value[i].data, value[i].data + value[i].len, '/')) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid sidecar suffix \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        suffix = ngx_array_push(wlcf->sidecar);
+        if (suffix == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *suffix = value[i];
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * webp_anim_keyframes kmin kmax;
+ *
+ * Bounds on the distance between key frames in animated output; kmax 1
+ * makes every frame a key frame.
+ */
+char *
+ngx_http_webp_anim_keyframes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_webp_loc_conf_t *wlcf = conf;
+    ngx_str_t *value;
+    ngx_int_t kmin, kmax;
+
+    if (wlcf->anim_kmax != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    kmin = ngx_atoi(value[1].data, value[1].len);
+    kmax = ngx_atoi(value[2].data, value[2].len);
+
+    if (kmin == NGX_ERROR || kmax == NGX_ERROR || kmax < 1 || kmin >= kmax) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid key frame distances \"%V %V\", kmin must be below kmax",
+                           &value[1], &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    wlcf->anim_kmin = kmin;
+    wlcf->anim_kmax = kmax;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * webp_quality_target off | ssim=value | psnr=dB | size=size
+ *                     [min=quality] [passes=number] [budget=time];
+ *
+ * SSIM is kept with 4 decimals and PSNR with 2, as fixed point.
+ */
+char *
+ngx_http_webp_quality_target(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_webp_loc_conf_t *wlcf = conf;
+    ngx_str_t *value, s;
+    ngx_uint_t i;
+    ngx_int_t n;
+    ssize_t size;
+
+    if (wlcf->target != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    i = 1;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            i = 2;
+            goto invalid;
+        }
+
+        wlcf->target = NGX_HTTP_WEBP_TARGET_NONE;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "ssim=", 5) == 0) {
+        n = ngx_atofp(value[1].data + 5, value[1].len - 5, 4);
+        if (n == NGX_ERROR || n == 0 || n >= 10000) {
+            goto invalid;
+        }
+
+        wlcf->target = NGX_HTTP_WEBP_TARGET_SSIM;
+        wlcf->target_value = n;
+
+    } else if (ngx_strncmp(value[1].data, "psnr=", 5) == 0) {
+        n = ngx_atofp(value[1].data + 5, value[1].len - 5, 2);
+        if (n == NGX_ERROR || n == 0 || n > 9900) {
+            goto invalid;
+        }
+
+        wlcf->target = NGX_HTTP_WEBP_TARGET_PSNR;
+        wlcf->target_value = n;
+
+    } else if (ngx_strncmp(value[1].data, "size=", 5) == 0) {
+        s.len = value[1].len - 5;
+        s.data = value[1].data + 5;
+
+        size = ngx_parse_size(&s);
+        if (size == NGX_ERROR || size == 0 || size > NGX_MAX_INT32_VALUE) {
+            goto invalid;
+        }
+
+        wlcf->target = NGX_HTTP_WEBP_TARGET_SIZE;
+        wlcf->target_value = size;
+
+    } else {
+        goto invalid;
+    }
+
+    wlcf->target_min = 10;
+    wlcf->target_passes = 6;
+    wlcf->target_budget = 1000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n > 100) {
+                goto invalid;
+            }
+
+            wlcf->target_min = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            /* libwebp accepts at most 10 passes for a size target */
+            if (n == NGX_ERROR || n < 1 || n > 10) {
+                goto invalid;
+            }
+
+            wlcf->target_passes = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "budget=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            wlcf->target_budget = ngx_parse_time(&s, 0);
+            if (wlcf->target_budget == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
 ngx_int_t
 ngx_http_webp_init(ngx_conf_t *cf)
 {
     ngx_http_handler_pt *h;
     ngx_http_core_main_conf_t *cmcf;
 
+    if (ngx_http_webp_add_variables(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    // Conversions run in the default thread pool
+    if (ngx_thread_pool_add(cf, NULL) == NULL) {
+        return NGX_ERROR;
+    }
+
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
     h = ngx_array_push(&cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers);
@@ -138,34 +747,37 @@ ngx_http_webp_init(ngx_conf_t *cf)
 
     *h = ngx_http_webp_handler;
 
-    return NGX_OK;
-}
-
-ngx_int_t
-ngx_http_webp_init_process(ngx_cycle_t *cycle)
-{
-    // Initialize any process-specific resources here
-    return NGX_OK;
+    return ngx_http_webp_filter_init(cf);
 }
 
+/*
+ * Caps conversions per second in this worker; hits never get here.  The
+ * window restarts every second, so bursts up to twice the rate can pass.
+ */
 ngx_int_t
 ngx_http_webp_limit_req(ngx_http_request_t *r)
 {
-    // Implement a simple rate limiting logic
-    static ngx_atomic_t request_count = 0;
+    ngx_http_webp_loc_conf_t *conf;
+    static ngx_uint_t request_count = 0;
     static ngx_msec_t last_checked = 0;
-    ngx_msec_t now = ngx_current_msec;
-    ngx_msec_t elapsed = now - last_checked;
-    ngx_int_t limit = 10; // Allow 10 requests per second
+    ngx_msec_t now;
 
-    if (elapsed > 1000) {
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+
+    if (conf->rate_limit == 0) {
+        return NGX_OK;
+    }
+
+    now = ngx_current_msec;
+
+    if (now - last_checked > 1000) {
         request_count = 0;
         last_checked = now;
     }
 
-    if (ngx_atomic_fetch_add(&request_count, 1) > limit) {
+    if (++request_count > conf->rate_limit) {
         return NGX_HTTP_TOO_MANY_REQUESTS;
     }
 
     return NGX_OK;
-}
\ No newline at end of file
+}
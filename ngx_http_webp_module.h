@@ -5,23 +5,14 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <ngx_thread_pool.h>
-#include <webp/encode.h>
-#include <webp/decode.h>
-#include <avif/avif.h>
 #include <ngx_sha1.h>
 
-#ifdef NGX_HTTP_WEBP_JXL_ENABLED
-#include <jxl/encode.h>
-#include <jxl/decode.h>
-#endif
+#include "ngx_http_webp_codec.h"
 
 #define NGX_HTTP_WEBP_LOG(level, log, err, fmt, ...) \
     ngx_log_error(level, log, err, "[ngx_http_webp_module] " fmt, ##__VA_ARGS__)
 
 extern ngx_module_t ngx_http_webp_module;
-extern ngx_str_t ngx_thread_pool_name;
-
-static ngx_str_t ngx_http_accept_header_key = ngx_string("accept");
 
 typedef struct {
     ngx_flag_t enable;
@@ -36,53 +27,251 @@ typedef struct {
     ngx_http_complex_value_t *quality_if;
     ngx_uint_t rate_limit;
     ngx_uint_t burst_limit;
+    ngx_array_t *sidecar;
+    ngx_flag_t filter;
+    ngx_uint_t anim_kmin;
+    ngx_uint_t anim_kmax;
+    ngx_flag_t anim_minimize_size;
+    ngx_flag_t anim_allow_mixed;
+    time_t original_better_time;
+    time_t decode_failed_time;
+    time_t too_large_time;
+    size_t segment_size;
+    size_t segment_max_object;
+    ngx_uint_t target;
+    ngx_uint_t target_value;
+    ngx_uint_t target_min;
+    ngx_uint_t target_passes;
+    ngx_msec_t target_budget;
 } ngx_http_webp_loc_conf_t;
 
+typedef struct {
+    ngx_uint_t files;
+    ngx_msec_t sleep;
+    ngx_msec_t threshold;
+} ngx_http_webp_cache_worker_conf_t;
+
+typedef struct {
+    ngx_http_webp_cache_worker_conf_t manager;
+    ngx_http_webp_cache_worker_conf_t loader;
+    ngx_array_t dirs;
+} ngx_http_webp_main_conf_t;
+
+/* one per cache directory, handed to the cache manager and loader */
+typedef struct {
+    ngx_path_t *path;
+    ngx_shm_zone_t *zone;
+    size_t max_size;
+    size_t segment_size;
+    time_t valid;
+    ngx_uint_t files;
+    ngx_uint_t loaded;
+    ngx_uint_t indexed;
+    ngx_uint_t removed;
+    ngx_msec_t last;
+    ngx_http_webp_main_conf_t *main;
+} ngx_http_webp_cache_dir_t;
+
+/* log2 buckets of microseconds, the last one catches everything above ~4s */
+#define NGX_HTTP_WEBP_HIST_BUCKETS 24
+
+typedef enum {
+    NGX_HTTP_WEBP_STAGE_READ = 0,
+    NGX_HTTP_WEBP_STAGE_DECODE,
+    NGX_HTTP_WEBP_STAGE_ENCODE,
+    NGX_HTTP_WEBP_STAGE_WRITE,
+    NGX_HTTP_WEBP_STAGE_MAX
+} ngx_http_webp_stage_e;
+
+typedef struct {
+    ngx_atomic_t buckets[NGX_HTTP_WEBP_HIST_BUCKETS];
+    ngx_atomic_t count;
+    ngx_atomic_t sum;
+} ngx_http_webp_histogram_t;
+
+typedef struct {
+    ngx_atomic_t hits;
+    ngx_atomic_t misses;
+    ngx_atomic_t conversions;
+    ngx_atomic_t failures;
+    ngx_atomic_t evictions;
+    ngx_atomic_t expired;
+    ngx_atomic_t negative_hits;
+    ngx_atomic_t original_better;
+    ngx_atomic_t bytes_in;
+    ngx_atomic_t bytes_out;
+    ngx_atomic_t queue_depth;
+    ngx_http_webp_histogram_t latency[NGX_HTTP_WEBP_STAGE_MAX];
+} ngx_http_webp_stats_t;
+
+#define ngx_http_webp_stats_add(stats, field, n)                              \
+    do {                                                                      \
+        if ((stats) != NULL) {                                                \
+            (void) ngx_atomic_fetch_add(&(stats)->field, n);                  \
+        }                                                                     \
+    } while (0)
+
+/*
+ * segment ids live in the upper half of the tail word, offsets in the lower;
+ * segment files are named "<generation>-<id>.seg"
+ */
+#define NGX_HTTP_WEBP_SEGMENTS 1024
+#define NGX_HTTP_WEBP_SEGMENT_SHIFT 32
+#define NGX_HTTP_WEBP_SEGMENT_NAME_LEN sizeof("/ffffffff-ffffffff.seg")
+
+/*
+ * refs counts requests between finding a variant in the slot and opening
+ * it; entries lists the index entries packed into it, under the zone mutex
+ */
+typedef struct {
+    ngx_atomic_t id;
+    ngx_atomic_t live;
+    ngx_atomic_t refs;
+    ngx_queue_t entries;
+} ngx_http_webp_segment_t;
+
+/* webp_cache_zone parameters, the zone data until the zone is initialized */
+typedef struct {
+    ngx_uint_t max_entries;
+} ngx_http_webp_zone_conf_t;
+
 typedef struct {
     ngx_rbtree_t rbtree;
     ngx_rbtree_node_t sentinel;
     ngx_queue_t queue;
+    ngx_rbtree_t sources;
+    ngx_rbtree_node_t sources_sentinel;
+    ngx_http_webp_stats_t stats;
+    size_t size;
+    ngx_uint_t entries;
+    ngx_uint_t max_entries;
+    ngx_atomic_t segment_tail;
+    ngx_uint_t generation;
+    ngx_http_webp_segment_t segments[NGX_HTTP_WEBP_SEGMENTS];
 } ngx_http_webp_shm_ctx_t;
 
+#define NGX_HTTP_WEBP_MAX_URI_LEN 65535
+
+/* secondary index: source URI -> every cached variant of it */
+typedef struct {
+    ngx_rbtree_node_t node;
+    ngx_queue_t variants;
+    u_short len;
+    u_char uri[1];
+} ngx_http_webp_source_t;
+
 typedef struct {
     ngx_rbtree_node_t node;
     ngx_queue_t queue;
-    u_char key[SHA256_DIGEST_LENGTH * 2];
-    ngx_str_t path;
+    ngx_queue_t variant;
+    ngx_queue_t packed;
+    ngx_http_webp_source_t *source;
+    u_char key[NGX_HTTP_WEBP_KEY_LEN];
     time_t expire;
+    time_t source_mtime;
+    size_t source_size;
+    size_t size;
+    ngx_uint_t segment;
+    off_t offset;
+    u_char quality;
+    u_char state;
 } ngx_http_webp_cache_entry_t;
 
+/* what the index knows about a key; anything but OK has no file behind it */
+#define NGX_HTTP_WEBP_STATE_OK               0
+#define NGX_HTTP_WEBP_STATE_ORIGINAL_BETTER  1
+#define NGX_HTTP_WEBP_STATE_DECODE_FAILED    2
+#define NGX_HTTP_WEBP_STATE_TOO_LARGE        3
+
+/* leading cache key characters in an ETag */
+#define NGX_HTTP_WEBP_ETAG_KEY_LEN           16
+
+/* encoded_quality of a variant whose quality libwebp chose, see size targets */
+#define NGX_HTTP_WEBP_QUALITY_UNKNOWN        0xff
+
+#define NGX_HTTP_WEBP_CACHE_BYPASS 0
+#define NGX_HTTP_WEBP_CACHE_MISS   1
+#define NGX_HTTP_WEBP_CACHE_HIT    2
+#define NGX_HTTP_WEBP_CACHE_STALE  3
+#define NGX_HTTP_WEBP_CACHE_SIDECAR 4
+#define NGX_HTTP_WEBP_CACHE_NEGATIVE 5
+
 typedef struct {
     ngx_str_t src_path;
     ngx_str_t dst_path;
+    ngx_str_t cache_key;
+    ngx_http_webp_format_e format;
     u_char *image_data;
     size_t image_size;
+    time_t source_mtime;
     ngx_uint_t quality;
-    uint8_t *webp_data;
+    ngx_uint_t encoded_quality;
     size_t webp_size;
+    ngx_uint_t segment;
+    off_t offset;
+    ngx_str_t segment_path;
+    uint64_t decode_usec;
+    uint64_t encode_usec;
     ngx_int_t result;
-    ngx_pool_t *pool;
+    ngx_uint_t state;
+    ngx_uint_t cache_status;
+    unsigned served:1;
+    ngx_uint_t filter;
+    size_t image_alloc;
+    ngx_buf_t *file;
+    ngx_http_request_t *request;
+    ngx_http_webp_stats_t *stats;
 } ngx_http_webp_convert_ctx_t;
 
 // Function prototypes
 ngx_int_t ngx_http_webp_handler(ngx_http_request_t *r);
 ngx_int_t ngx_http_webp_init(ngx_conf_t *cf);
+void* ngx_http_webp_create_main_conf(ngx_conf_t *cf);
+char* ngx_http_webp_init_main_conf(ngx_conf_t *cf, void *conf);
 void* ngx_http_webp_create_loc_conf(ngx_conf_t *cf);
 char* ngx_http_webp_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
-void ngx_http_webp_cleanup_cache(ngx_event_t *ev);
-ngx_int_t ngx_http_webp_init_process(ngx_cycle_t *cycle);
 ngx_int_t ngx_http_webp_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data);
-static void ngx_http_webp_convert_thread_handler(void *data, ngx_log_t *log);
-ngx_int_t ngx_http_webp_convert_image(ngx_http_request_t *r, ngx_str_t *src_path, ngx_str_t *dst_path);
-ngx_int_t ngx_http_webp_lookup_cache(ngx_http_request_t *r, ngx_str_t *cache_key, ngx_str_t *file_path);
-ngx_int_t ngx_http_webp_store_cache(ngx_http_request_t *r, ngx_str_t *webp_path, uint8_t *webp_data, size_t webp_size);
+void ngx_http_webp_params(ngx_http_webp_loc_conf_t *conf, ngx_uint_t quality, ngx_http_webp_params_t *params);
+ngx_int_t ngx_http_webp_convert_image(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx);
+ngx_int_t ngx_http_webp_post_conversion(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx, ngx_event_handler_pt handler);
+ngx_uint_t ngx_http_webp_accepts_webp(ngx_http_request_t *r);
+void ngx_http_webp_record_outcome(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx);
+ngx_int_t ngx_http_webp_filter_init(ngx_conf_t *cf);
+ngx_int_t ngx_http_webp_lookup_cache(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *rctx);
+ngx_int_t ngx_http_webp_store_cache(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *rctx);
+void ngx_http_webp_invalidate_cache(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *rctx);
+ngx_int_t ngx_http_webp_cache_add_file(ngx_shm_zone_t *zone, ngx_str_t *key, size_t size, time_t mtime, time_t valid);
+void ngx_http_webp_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+ngx_int_t ngx_http_webp_cache_key(ngx_http_request_t *r, ngx_str_t *uri, ngx_uint_t quality, ngx_str_t *cache_key,
+    ngx_str_t *cache_path);
+ngx_int_t ngx_http_webp_quality(ngx_http_request_t *r, ngx_http_webp_loc_conf_t *conf, ngx_uint_t *quality);
 ngx_int_t ngx_http_webp_serve_file(ngx_http_request_t *r, ngx_str_t *path);
+ngx_int_t ngx_http_webp_set_validators(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx);
+ngx_int_t ngx_http_webp_not_modified(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx);
 char* ngx_http_webp_set_complex_value_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 ngx_int_t ngx_http_webp_limit_req(ngx_http_request_t *r);
-ngx_int_t ngx_http_webp_invalidate_cache(ngx_http_request_t *r);
-
-// WebP function declarations
-uint8_t* WebPDecodePNG(const uint8_t* data, size_t data_size, int* width, int* height);
-uint8_t* WebPDecodeJPEG(const uint8_t* data, size_t data_size, int* width, int* height);
+void ngx_http_webp_source_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+char* ngx_http_webp_purge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char* ngx_http_webp_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char* ngx_http_webp_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char* ngx_http_webp_sidecar(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char* ngx_http_webp_anim_keyframes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char* ngx_http_webp_quality_target(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_http_webp_stats_t* ngx_http_webp_stats(ngx_http_request_t *r);
+void ngx_http_webp_stats_observe(ngx_http_webp_stats_t *stats, ngx_http_webp_stage_e stage, uint64_t usec);
+uint64_t ngx_http_webp_usec(void);
+char* ngx_http_webp_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_webp_add_variables(ngx_conf_t *cf);
+void ngx_http_webp_cache_delete_locked(ngx_http_webp_shm_ctx_t *ctx, ngx_slab_pool_t *shpool, ngx_http_webp_cache_entry_t *entry);
+char* ngx_http_webp_cache_worker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_webp_add_cache_dir(ngx_conf_t *cf, ngx_http_webp_loc_conf_t *conf);
+ngx_str_t* ngx_http_webp_zone_cache_dir(ngx_http_request_t *r, ngx_shm_zone_t *zone);
+ngx_http_webp_cache_entry_t* ngx_http_webp_cache_find(ngx_http_webp_shm_ctx_t *ctx, ngx_str_t *cache_key, uint32_t hash);
+u_char* ngx_http_webp_segment_name(u_char *buf, ngx_str_t *dir, ngx_uint_t generation, ngx_uint_t id);
+void ngx_http_webp_segment_unref(void *data);
+ngx_int_t ngx_http_webp_segment_store(ngx_http_webp_convert_ctx_t *ctx, ngx_http_webp_loc_conf_t *conf, u_char *data, size_t size, ngx_log_t *log);
+void ngx_http_webp_segment_release(ngx_http_webp_shm_ctx_t *shctx, ngx_uint_t id, size_t size);
+ngx_int_t ngx_http_webp_segment_path(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx);
+ngx_int_t ngx_http_webp_segment_compact(ngx_shm_zone_t *zone, ngx_str_t *dir, size_t segment_size, ngx_log_t *log);
 
 #endif /* _NGX_HTTP_WEBP_MODULE_H_INCLUDED_ */
\ No newline at end of file
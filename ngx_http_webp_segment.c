@@ -0,0 +1,373 @@
+#include "ngx_http_webp_module.h"
+
+/*
+ * Packed store: small variants are appended to large segment files,
+ * "<cache_dir>/<generation>-<id>.seg", and indexed as (segment, offset,
+ * size).  Ids restart with every new zone, the generation keeps a fresh
+ * zone from appending to the segments of an earlier one.  Space is
+ * handed out lock-free from a single tail word, (id << 32 | offset), so
+ * conversions running in the thread pools of all workers can reserve it
+ * without the zone mutex.  Each segment id maps onto a slot that counts
+ * its live bytes; compaction moves survivors out of sparse segments and
+ * deletes segments that have no live bytes left and no request about to
+ * open them.
+ */
+
+#define NGX_HTTP_WEBP_SEGMENT_MASK (((ngx_atomic_uint_t) 1 << NGX_HTTP_WEBP_SEGMENT_SHIFT) - 1)
+
+/* entries moved per compaction pass */
+#define NGX_HTTP_WEBP_COMPACT_BATCH  64
+
+typedef struct {
+    u_char key[NGX_HTTP_WEBP_KEY_LEN];
+    off_t offset;
+    size_t size;
+} ngx_http_webp_compact_item_t;
+
+u_char *
+ngx_http_webp_segment_name(u_char *buf, ngx_str_t *dir, ngx_uint_t generation, ngx_uint_t id)
+{
+    return ngx_sprintf(buf, "%V/%08xi-%08xi.seg%Z", dir, generation, id);
+}
+
+/* pool cleanup of a request that lookup_cache() pointed at a segment */
+void
+ngx_http_webp_segment_unref(void *data)
+{
+    ngx_http_webp_segment_t *slot = data;
+
+    (void) ngx_atomic_fetch_add(&slot->refs, -1);
+}
+
+/*
+ * Live bytes are accounted before the tail moves, so a segment that has a
+ * reservation in flight never looks empty to compaction.
+ */
+static ngx_int_t
+ngx_http_webp_segment_reserve(ngx_http_webp_shm_ctx_t *shctx, size_t segment_size, size_t size,
+    ngx_uint_t *id, off_t *offset)
+{
+    ngx_http_webp_segment_t *slot;
+    ngx_atomic_uint_t old, tail, seg, off;
+    ngx_uint_t rolled;
+
+    for ( ;; ) {
+        old = shctx->segment_tail;
+        seg = old >> NGX_HTTP_WEBP_SEGMENT_SHIFT;
+        off = old & NGX_HTTP_WEBP_SEGMENT_MASK;
+
+        rolled = (seg == 0 || off + size > segment_size);
+
+        if (rolled) {
+            seg++;
+            off = 0;
+            tail = (seg << NGX_HTTP_WEBP_SEGMENT_SHIFT) | size;
+
+        } else {
+            tail = old + size;
+        }
+
+        slot = &shctx->segments[seg % NGX_HTTP_WEBP_SEGMENTS];
+
+        if (rolled) {
+            if (slot->id == seg) {
+                /* another process is rolling over right now */
+                ngx_sched_yield();
+                continue;
+            }
+
+            /* the slot has to be reclaimed by compaction before it is reused */
+
+            if (!ngx_atomic_cmp_set(&slot->id, 0, seg)) {
+                return NGX_DECLINED;
+            }
+        }
+
+        (void) ngx_atomic_fetch_add(&slot->live, size);
+
+        if (ngx_atomic_cmp_set(&shctx->segment_tail, old, tail)) {
+            break;
+        }
+
+        (void) ngx_atomic_fetch_add(&slot->live, -(ngx_atomic_int_t) size);
+
+        if (rolled) {
+            slot->id = 0;
+        }
+    }
+
+    *id = seg;
+    *offset = off;
+
+    return NGX_OK;
+}
+
+void
+ngx_http_webp_segment_release(ngx_http_webp_shm_ctx_t *shctx, ngx_uint_t id, size_t size)
+{
+    (void) ngx_atomic_fetch_add(&shctx->segments[id % NGX_HTTP_WEBP_SEGMENTS].live,
+                                -(ngx_atomic_int_t) size);
+}
+
+static ngx_int_t
+ngx_http_webp_segment_write(u_char *path, u_char *data, size_t size, off_t offset, ngx_log_t *log)
+{
+    ngx_file_t file;
+    ssize_t n;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.data = path;
+    file.name.len = ngx_strlen(path);
+    file.log = log;
+
+    file.fd = ngx_open_file(path, NGX_FILE_WRONLY, NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "Failed to open segment: %s", path);
+        return NGX_ERROR;
+    }
+
+    n = ngx_write_file(&file, data, size, offset);
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        n = NGX_ERROR;
+    }
+
+    return (n == (ssize_t) size) ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * Appends an encoded variant to the current segment.  Runs in the thread
+ * pool; NGX_DECLINED asks the caller to fall back to a file of its own.
+ */
+ngx_int_t
+ngx_http_webp_segment_store(ngx_http_webp_convert_ctx_t *ctx, ngx_http_webp_loc_conf_t *conf,
+    u_char *data, size_t size, ngx_log_t *log)
+{
+    ngx_http_webp_shm_ctx_t *shctx;
+    ngx_uint_t id;
+    off_t offset;
+    u_char *p;
+
+    shctx = conf->cache_zone->data;
+
+    if (ngx_http_webp_segment_reserve(shctx, conf->segment_size, size, &id, &offset) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    p = ngx_http_webp_segment_name(ctx->segment_path.data, &conf->cache_dir, shctx->generation, id);
+    ctx->segment_path.len = p - ctx->segment_path.data - 1;
+
+    if (ngx_http_webp_segment_write(ctx->segment_path.data, data, size, offset, log) != NGX_OK) {
+        ngx_http_webp_segment_release(shctx, id, size);
+        return NGX_DECLINED;
+    }
+
+    ctx->segment = id;
+    ctx->offset = offset;
+
+    return NGX_OK;
+}
+
+/*
+ * Allocates ctx->segment_path, which the thread handler fills in, and, for
+ * a variant found in the index, points it at the segment holding it.
+ */
+ngx_int_t
+ngx_http_webp_segment_path(ngx_http_request_t *r, ngx_http_webp_convert_ctx_t *ctx)
+{
+    ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+    ngx_http_webp_shm_ctx_t *shctx;
+    u_char *p;
+
+    if (ctx->segment_path.data == NULL) {
+        ctx->segment_path.data = ngx_pnalloc(r->pool, conf->cache_dir.len + NGX_HTTP_WEBP_SEGMENT_NAME_LEN);
+        if (ctx->segment_path.data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ctx->segment) {
+        shctx = conf->cache_zone->data;
+        p = ngx_http_webp_segment_name(ctx->segment_path.data, &conf->cache_dir, shctx->generation, ctx->segment);
+        ctx->segment_path.len = p - ctx->segment_path.data - 1;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * One compaction pass: deletes segments without live bytes, then moves up
+ * to NGX_HTTP_WEBP_COMPACT_BATCH entries out of the sparsest segment that
+ * is less than half full.  Entries are relocated only if they are still
+ * where they were when collected; otherwise the copy is released again.
+ */
+ngx_int_t
+ngx_http_webp_segment_compact(ngx_shm_zone_t *zone, ngx_str_t *dir, size_t segment_size, ngx_log_t *log)
+{
+    ngx_http_webp_compact_item_t items[NGX_HTTP_WEBP_COMPACT_BATCH];
+    ngx_http_webp_cache_entry_t *entry;
+    ngx_http_webp_shm_ctx_t *shctx;
+    ngx_http_webp_segment_t *slot;
+    ngx_slab_pool_t *shpool;
+    ngx_uint_t i, n, id, current, victim;
+    ngx_atomic_uint_t live, best;
+    ngx_file_t file;
+    ngx_queue_t *q;
+    ngx_str_t key;
+    u_char *src, *dst, *buf;
+    off_t offset;
+    ssize_t rc;
+
+    shctx = zone->data;
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    src = ngx_alloc(dir->len + NGX_HTTP_WEBP_SEGMENT_NAME_LEN, log);
+    dst = ngx_alloc(dir->len + NGX_HTTP_WEBP_SEGMENT_NAME_LEN, log);
+
+    if (src == NULL || dst == NULL) {
+        ngx_free(src);
+        ngx_free(dst);
+        return NGX_ERROR;
+    }
+
+    /* segments opened after this point are newer than "current" */
+
+    current = shctx->segment_tail >> NGX_HTTP_WEBP_SEGMENT_SHIFT;
+    victim = 0;
+    best = segment_size / 2;
+
+    for (i = 0; i < NGX_HTTP_WEBP_SEGMENTS; i++) {
+        slot = &shctx->segments[i];
+        id = slot->id;
+
+        if (id == 0 || id >= current) {
+            continue;
+        }
+
+        live = slot->live;
+
+        /*
+         * live drops to zero only after the last entry in the segment left
+         * the index, and lookup_cache() takes its reference before that
+         */
+
+        ngx_memory_barrier();
+
+        if (live == 0 && slot->refs == 0) {
+            ngx_http_webp_segment_name(src, dir, shctx->generation, id);
+
+            if (ngx_delete_file(src) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+                ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "Failed to delete segment: %s", src);
+                continue;
+            }
+
+            (void) ngx_atomic_cmp_set(&slot->id, id, 0);
+            continue;
+        }
+
+        if (live != 0 && live < best) {
+            best = live;
+            victim = id;
+        }
+    }
+
+    if (victim == 0) {
+        goto done;
+    }
+
+    /* only the victim's own entries are visited, not the whole index */
+
+    slot = &shctx->segments[victim % NGX_HTTP_WEBP_SEGMENTS];
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    n = 0;
+
+    for (q = ngx_queue_head(&slot->entries);
+         q != ngx_queue_sentinel(&slot->entries) && n < NGX_HTTP_WEBP_COMPACT_BATCH;
+         q = ngx_queue_next(q))
+    {
+        entry = ngx_queue_data(q, ngx_http_webp_cache_entry_t, packed);
+
+        if (entry->segment == victim) {
+            ngx_memcpy(items[n].key, entry->key, NGX_HTTP_WEBP_KEY_LEN);
+            items[n].offset = entry->offset;
+            items[n].size = entry->size;
+            n++;
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_http_webp_segment_name(src, dir, shctx->generation, victim);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.data = src;
+    file.name.len = ngx_strlen(src);
+    file.log = log;
+
+    file.fd = ngx_open_file(src, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "Failed to open segment: %s", src);
+        goto done;
+    }
+
+    for (i = 0; i < n; i++) {
+        buf = ngx_alloc(items[i].size, log);
+        if (buf == NULL) {
+            break;
+        }
+
+        rc = ngx_read_file(&file, buf, items[i].size, items[i].offset);
+
+        if (rc != (ssize_t) items[i].size
+            || ngx_http_webp_segment_reserve(shctx, segment_size, items[i].size, &id, &offset) != NGX_OK)
+        {
+            ngx_free(buf);
+            break;
+        }
+
+        ngx_http_webp_segment_name(dst, dir, shctx->generation, id);
+
+        if (ngx_http_webp_segment_write(dst, buf, items[i].size, offset, log) != NGX_OK) {
+            ngx_http_webp_segment_release(shctx, id, items[i].size);
+            ngx_free(buf);
+            break;
+        }
+
+        ngx_free(buf);
+
+        key.len = NGX_HTTP_WEBP_KEY_LEN;
+        key.data = items[i].key;
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        entry = ngx_http_webp_cache_find(shctx, &key, ngx_crc32_long(key.data, key.len));
+
+        if (entry != NULL && entry->segment == victim && entry->offset == items[i].offset) {
+            entry->segment = id;
+            entry->offset = offset;
+
+            ngx_queue_remove(&entry->packed);
+            ngx_queue_insert_tail(&shctx->segments[id % NGX_HTTP_WEBP_SEGMENTS].entries, &entry->packed);
+            ngx_http_webp_segment_release(shctx, victim, items[i].size);
+
+        } else {
+            /* purged or replaced meanwhile, the copy is garbage */
+            ngx_http_webp_segment_release(shctx, id, items[i].size);
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    ngx_close_file(file.fd);
+
+done:
+
+    ngx_free(src);
+    ngx_free(dst);
+
+    return NGX_OK;
+}
@@ -0,0 +1,252 @@
+#include "ngx_http_webp_module.h"
+
+#define NGX_HTTP_WEBP_STATUS_LINE_MAX 192
+
+static ngx_str_t ngx_http_webp_stage_names[] = {
+    ngx_string("read"),
+    ngx_string("decode"),
+    ngx_string("encode"),
+    ngx_string("write")
+};
+
+static ngx_int_t ngx_http_webp_status_handler(ngx_http_request_t *r);
+
+ngx_http_webp_stats_t *
+ngx_http_webp_stats(ngx_http_request_t *r)
+{
+    ngx_http_webp_loc_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+    ngx_http_webp_shm_ctx_t *ctx;
+
+    if (conf->cache_zone == NULL || conf->cache_zone->data == NULL) {
+        return NULL;
+    }
+
+    ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
+
+    return &ctx->stats;
+}
+
+uint64_t
+ngx_http_webp_usec(void)
+{
+    struct timeval tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Safe to call from thread pool tasks, only atomics are touched.
+ * Bucket i counts samples of at most 2^i microseconds.
+ */
+void
+ngx_http_webp_stats_observe(ngx_http_webp_stats_t *stats, ngx_http_webp_stage_e stage, uint64_t usec)
+{
+    ngx_http_webp_histogram_t *h;
+    ngx_uint_t i;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    h = &stats->latency[stage];
+
+    for (i = 0; i < NGX_HTTP_WEBP_HIST_BUCKETS - 1; i++) {
+        if (usec <= ((uint64_t) 1 << i)) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&h->buckets[i], 1);
+    (void) ngx_atomic_fetch_add(&h->count, 1);
+    (void) ngx_atomic_fetch_add(&h->sum, (ngx_atomic_int_t) usec);
+}
+
+char *
+ngx_http_webp_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_webp_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+static u_char *
+ngx_http_webp_status_json(u_char *p, ngx_str_t *zone, ngx_http_webp_stats_t *st)
+{
+    ngx_http_webp_histogram_t *h;
+    ngx_uint_t i, j;
+
+    p = ngx_sprintf(p, "{\"zone\":\"%V\",", zone);
+    p = ngx_sprintf(p, "\"hits\":%uA,\"misses\":%uA,", st->hits, st->misses);
+    p = ngx_sprintf(p, "\"conversions\":%uA,\"failures\":%uA,", st->conversions, st->failures);
+    p = ngx_sprintf(p, "\"evictions\":%uA,\"expired\":%uA,", st->evictions, st->expired);
+    p = ngx_sprintf(p, "\"negative_hits\":%uA,\"original_better\":%uA,", st->negative_hits, st->original_better);
+    p = ngx_sprintf(p, "\"bytes_in\":%uA,\"bytes_out\":%uA,", st->bytes_in, st->bytes_out);
+    p = ngx_sprintf(p, "\"thread_queue_depth\":%uA,", st->queue_depth);
+    p = ngx_sprintf(p, "\"latency_us\":{");
+
+    for (i = 0; i < NGX_HTTP_WEBP_STAGE_MAX; i++) {
+        h = &st->latency[i];
+
+        p = ngx_sprintf(p, "%s\"%V\":{\"count\":%uA,\"sum\":%uA,\"buckets\":[",
+                        i ? "," : "", &ngx_http_webp_stage_names[i], h->count, h->sum);
+
+        for (j = 0; j < NGX_HTTP_WEBP_HIST_BUCKETS; j++) {
+            if (j == NGX_HTTP_WEBP_HIST_BUCKETS - 1) {
+                p = ngx_sprintf(p, "%s{\"le\":null,\"count\":%uA}", j ? "," : "", h->buckets[j]);
+            } else {
+                p = ngx_sprintf(p, "%s{\"le\":%uL,\"count\":%uA}", j ? "," : "",
+                                (uint64_t) 1 << j, h->buckets[j]);
+            }
+        }
+
+        p = ngx_sprintf(p, "]}");
+    }
+
+    return ngx_sprintf(p, "}}" CRLF);
+}
+
+static u_char *
+ngx_http_webp_status_prometheus(u_char *p, ngx_str_t *zone, ngx_http_webp_stats_t *st)
+{
+    ngx_http_webp_histogram_t *h;
+    ngx_atomic_uint_t cumulative, sum;
+    ngx_uint_t i, j;
+
+#define ngx_http_webp_prom_counter(name, value)                               \
+    p = ngx_sprintf(p, "# TYPE ngx_webp_" name " counter\n"                   \
+                    "ngx_webp_" name "{zone=\"%V\"} %uA\n", zone, value)
+
+    ngx_http_webp_prom_counter("cache_hits_total", st->hits);
+    ngx_http_webp_prom_counter("cache_misses_total", st->misses);
+    ngx_http_webp_prom_counter("conversions_total", st->conversions);
+    ngx_http_webp_prom_counter("conversion_failures_total", st->failures);
+    ngx_http_webp_prom_counter("cache_evictions_total", st->evictions);
+    ngx_http_webp_prom_counter("cache_expired_total", st->expired);
+    ngx_http_webp_prom_counter("negative_hits_total", st->negative_hits);
+    ngx_http_webp_prom_counter("original_better_total", st->original_better);
+    ngx_http_webp_prom_counter("source_bytes_total", st->bytes_in);
+    ngx_http_webp_prom_counter("output_bytes_total", st->bytes_out);
+
+#undef ngx_http_webp_prom_counter
+
+    p = ngx_sprintf(p, "# TYPE ngx_webp_thread_queue_depth gauge\n"
+                    "ngx_webp_thread_queue_depth{zone=\"%V\"} %uA\n",
+                    zone, st->queue_depth);
+
+    p = ngx_sprintf(p, "# TYPE ngx_webp_stage_duration_seconds histogram\n");
+
+    for (i = 0; i < NGX_HTTP_WEBP_STAGE_MAX; i++) {
+        h = &st->latency[i];
+        sum = h->sum;
+        cumulative = 0;
+
+        for (j = 0; j < NGX_HTTP_WEBP_HIST_BUCKETS - 1; j++) {
+            cumulative += h->buckets[j];
+
+            p = ngx_sprintf(p, "ngx_webp_stage_duration_seconds_bucket"
+                            "{zone=\"%V\",stage=\"%V\",le=\"%uL.%06uL\"} %uA\n",
+                            zone, &ngx_http_webp_stage_names[i],
+                            ((uint64_t) 1 << j) / 1000000, ((uint64_t) 1 << j) % 1000000,
+                            cumulative);
+        }
+
+        cumulative += h->buckets[j];
+
+        p = ngx_sprintf(p, "ngx_webp_stage_duration_seconds_bucket"
+                        "{zone=\"%V\",stage=\"%V\",le=\"+Inf\"} %uA\n",
+                        zone, &ngx_http_webp_stage_names[i], cumulative);
+
+        p = ngx_sprintf(p, "ngx_webp_stage_duration_seconds_sum"
+                        "{zone=\"%V\",stage=\"%V\"} %uA.%06uA\n",
+                        zone, &ngx_http_webp_stage_names[i],
+                        sum / 1000000, sum % 1000000);
+
+        p = ngx_sprintf(p, "ngx_webp_stage_duration_seconds_count"
+                        "{zone=\"%V\",stage=\"%V\"} %uA\n",
+                        zone, &ngx_http_webp_stage_names[i], h->count);
+    }
+
+    return p;
+}
+
+static ngx_int_t
+ngx_http_webp_status_handler(ngx_http_request_t *r)
+{
+    ngx_http_webp_loc_conf_t *conf;
+    ngx_http_webp_shm_ctx_t *ctx;
+    ngx_str_t format, *zone;
+    ngx_uint_t prometheus;
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+    size_t len;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_webp_module);
+
+    if (conf->cache_zone == NULL || conf->cache_zone->data == NULL) {
+        NGX_HTTP_WEBP_LOG(NGX_LOG_ERR, r->connection->log, 0,
+                          "webp_status: no cache zone configured for this location");
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    ctx = (ngx_http_webp_shm_ctx_t *)conf->cache_zone->data;
+    zone = &conf->cache_zone->shm.name;
+
+    prometheus = ngx_http_arg(r, (u_char *) "format", 6, &format) == NGX_OK
+                 && format.len == 10
+                 && ngx_strncmp(format.data, "prometheus", 10) == 0;
+
+    if (prometheus) {
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    /* one line per counter and per histogram bucket, plus headers */
+    len = (18 + NGX_HTTP_WEBP_STAGE_MAX * (NGX_HTTP_WEBP_HIST_BUCKETS + 3))
+          * (NGX_HTTP_WEBP_STATUS_LINE_MAX + zone->len);
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (prometheus) {
+        b->last = ngx_http_webp_status_prometheus(b->last, zone, &ctx->stats);
+    } else {
+        b->last = ngx_http_webp_status_json(b->last, zone, &ctx->stats);
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
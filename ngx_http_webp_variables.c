@@ -0,0 +1,182 @@
+#include "ngx_http_webp_module.h"
+
+#define NGX_HTTP_WEBP_VAR_CACHE_STATUS  0
+#define NGX_HTTP_WEBP_VAR_FORMAT        1
+#define NGX_HTTP_WEBP_VAR_DECODE_TIME   2
+#define NGX_HTTP_WEBP_VAR_ENCODE_TIME   3
+#define NGX_HTTP_WEBP_VAR_CONVERT_TIME  4
+#define NGX_HTTP_WEBP_VAR_SOURCE_SIZE   5
+#define NGX_HTTP_WEBP_VAR_OUTPUT_SIZE   6
+#define NGX_HTTP_WEBP_VAR_BYTES_SAVED   7
+#define NGX_HTTP_WEBP_VAR_QUALITY       8
+
+static ngx_int_t ngx_http_webp_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_str_t ngx_http_webp_cache_status_names[] = {
+    ngx_string("BYPASS"),
+    ngx_string("MISS"),
+    ngx_string("HIT"),
+    ngx_string("STALE"),
+    ngx_string("SIDECAR"),
+    ngx_string("NEGATIVE")
+};
+
+static ngx_http_variable_t ngx_http_webp_vars[] = {
+    { ngx_string("webp_cache_status"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_CACHE_STATUS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("webp_format"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_FORMAT, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("webp_decode_time"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_DECODE_TIME, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("webp_encode_time"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_ENCODE_TIME, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("webp_convert_time"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_CONVERT_TIME, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("webp_source_size"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_SOURCE_SIZE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("webp_output_size"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_OUTPUT_SIZE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("webp_bytes_saved"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_BYTES_SAVED, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("webp_quality"), NULL, ngx_http_webp_variable,
+      NGX_HTTP_WEBP_VAR_QUALITY, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    ngx_http_null_variable
+};
+
+ngx_int_t
+ngx_http_webp_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t *var, *v;
+
+    for (v = ngx_http_webp_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_webp_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_webp_convert_ctx_t *ctx;
+    uint64_t usec;
+    u_char *p;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_webp_module);
+
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    switch (data) {
+
+    case NGX_HTTP_WEBP_VAR_CACHE_STATUS:
+        v->len = ngx_http_webp_cache_status_names[ctx->cache_status].len;
+        v->data = ngx_http_webp_cache_status_names[ctx->cache_status].data;
+        break;
+
+    case NGX_HTTP_WEBP_VAR_FORMAT:
+        if (ctx->served) {
+            ngx_str_set(v, "webp");
+        } else {
+            ngx_str_set(v, "original");
+        }
+        break;
+
+    case NGX_HTTP_WEBP_VAR_DECODE_TIME:
+    case NGX_HTTP_WEBP_VAR_ENCODE_TIME:
+    case NGX_HTTP_WEBP_VAR_CONVERT_TIME:
+
+        /* only conversions done for this request are timed */
+        if (ctx->decode_usec == 0 && ctx->encode_usec == 0) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+
+        usec = (data == NGX_HTTP_WEBP_VAR_DECODE_TIME) ? ctx->decode_usec
+               : (data == NGX_HTTP_WEBP_VAR_ENCODE_TIME) ? ctx->encode_usec
+               : ctx->decode_usec + ctx->encode_usec;
+
+        p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* seconds with millisecond resolution, like $request_time */
+        v->len = ngx_sprintf(p, "%uL.%03uL", usec / 1000000, (usec / 1000) % 1000) - p;
+        v->data = p;
+        break;
+
+    case NGX_HTTP_WEBP_VAR_SOURCE_SIZE:
+    case NGX_HTTP_WEBP_VAR_OUTPUT_SIZE:
+    case NGX_HTTP_WEBP_VAR_BYTES_SAVED:
+
+        if (!ctx->served || ctx->image_size == 0) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+
+        p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN + 1);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (data == NGX_HTTP_WEBP_VAR_SOURCE_SIZE) {
+            v->len = ngx_sprintf(p, "%uz", ctx->image_size) - p;
+
+        } else if (data == NGX_HTTP_WEBP_VAR_OUTPUT_SIZE) {
+            v->len = ngx_sprintf(p, "%uz", ctx->webp_size) - p;
+
+        } else {
+            v->len = ngx_sprintf(p, "%O", (off_t) ctx->image_size - (off_t) ctx->webp_size) - p;
+        }
+
+        v->data = p;
+        break;
+
+    case NGX_HTTP_WEBP_VAR_QUALITY:
+
+        if (!ctx->served
+            || ctx->cache_status == NGX_HTTP_WEBP_CACHE_SIDECAR
+            || ctx->encoded_quality == NGX_HTTP_WEBP_QUALITY_UNKNOWN)
+        {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+
+        p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        v->len = ngx_sprintf(p, "%ui", ctx->encoded_quality) - p;
+        v->data = p;
+        break;
+
+    default:
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
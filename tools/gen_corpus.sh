@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Generates a reference corpus for ngx_webp_bench: photo-like (plasma) and
+# flat (gradient + text) images at several sizes in every source format the
+# module converts.  Needs ImageMagick; avifenc and cjxl are used when found.
+#
+#   ./gen_corpus.sh [output_dir]
+
+set -e
+
+out=${1:-corpus}
+sizes="320x240 1280x720 1920x1080 4000x3000"
+
+command -v convert >/dev/null || { echo "ImageMagick 'convert' not found" >&2; exit 1; }
+
+mkdir -p "$out"
+
+for size in $sizes; do
+    for kind in photo flat; do
+        base="$out/$kind-$size"
+
+        if [ "$kind" = photo ]; then
+            convert -seed 1 -size "$size" plasma:fractal -blur 0x1 "$base.png"
+        else
+            convert -size "$size" gradient:navy-orange \
+                    -gravity center -pointsize 48 -annotate 0 "ngx_webp_bench" "$base.png"
+        fi
+
+        convert "$base.png" -quality 90 "$base.jpg"
+
+        # PNG with a real alpha channel
+        convert "$base.png" -alpha set -channel A -fx "0.5+0.5*i/w" "$base-alpha.png"
+
+        if command -v avifenc >/dev/null; then
+            avifenc -q 60 "$base.png" "$base.avif" >/dev/null
+        fi
+
+        if command -v cjxl >/dev/null; then
+            cjxl -q 90 "$base.png" "$base.jxl" >/dev/null 2>&1
+        fi
+    done
+done
+
+echo "corpus written to $out"
@@ -0,0 +1,451 @@
+/*
+ * ngx_webp_batch - pre-generates the module's WebP cache from a file tree.
+ *
+ * Every source file below the document root is converted with the same
+ * codec core the module links and written to the same "<cache_dir>/<key>.webp"
+ * path the module would use for the request URI, so the output can be
+ * rsync'ed onto edge nodes as is.
+ */
+
+#define _GNU_SOURCE
+
+#include "../ngx_http_webp_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+typedef struct {
+    char *path;
+} ngx_webp_batch_job_t;
+
+/*
+ * One deque per worker.  The owner pops from the tail, idle workers steal
+ * from the head; jobs are never added once the pool is started.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *items;
+    size_t head;
+    size_t tail;
+} ngx_webp_batch_deque_t;
+
+typedef struct {
+    ngx_webp_batch_deque_t *deques;
+    int nworkers;
+    ngx_webp_batch_job_t *jobs;
+    size_t njobs;
+    size_t jobs_size;
+    const char *root;
+    const char *cache_dir;
+    const char *uri_prefix;
+    ngx_http_webp_params_t params;
+    size_t max_image_size;
+    int force;
+    int verbose;
+    pthread_mutex_t stats_lock;
+    size_t converted;
+    size_t skipped;
+    size_t larger;
+    size_t failed;
+    size_t bytes_in;
+    size_t bytes_out;
+} ngx_webp_batch_t;
+
+typedef struct {
+    ngx_webp_batch_t *batch;
+    int id;
+} ngx_webp_batch_worker_t;
+
+static ngx_webp_batch_t batch;
+
+static int
+ngx_webp_batch_collect(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    ngx_webp_batch_job_t *jobs;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    if (ngx_http_webp_codec_format(path, strlen(path)) == NGX_HTTP_WEBP_FORMAT_UNKNOWN) {
+        return 0;
+    }
+
+    if (batch.njobs == batch.jobs_size) {
+        batch.jobs_size = batch.jobs_size ? batch.jobs_size * 2 : 1024;
+        jobs = realloc(batch.jobs, batch.jobs_size * sizeof(ngx_webp_batch_job_t));
+        if (jobs == NULL) {
+            return -1;
+        }
+        batch.jobs = jobs;
+    }
+
+    batch.jobs[batch.njobs].path = strdup(path);
+    if (batch.jobs[batch.njobs].path == NULL) {
+        return -1;
+    }
+
+    batch.njobs++;
+
+    return 0;
+}
+
+static int
+ngx_webp_batch_read(const char *path, uint8_t **data, size_t *size, size_t max)
+{
+    struct stat st;
+    uint8_t *buf;
+    ssize_t n;
+    size_t done;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size > max) {
+        close(fd);
+        return -1;
+    }
+
+    buf = malloc(st.st_size ? st.st_size : 1);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    for (done = 0; done < (size_t) st.st_size; done += n) {
+        n = read(fd, buf + done, st.st_size - done);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            free(buf);
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(fd);
+
+    *data = buf;
+    *size = st.st_size;
+
+    return 0;
+}
+
+static void
+ngx_webp_batch_process(ngx_webp_batch_t *b, ngx_webp_batch_job_t *job)
+{
+    char uri[4096], material[4096 + NGX_HTTP_WEBP_KEY_MATERIAL_LEN], key[NGX_HTTP_WEBP_KEY_LEN + 1], dst[4096];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    ngx_http_webp_output_t out;
+    struct stat src_st, dst_st;
+    const char *rel;
+    uint8_t *data;
+    size_t size, out_size, len, prefix_len;
+    int rc;
+
+    rel = job->path + strlen(b->root);
+    while (*rel == '/') {
+        rel++;
+    }
+
+    prefix_len = strlen(b->uri_prefix);
+    while (prefix_len && b->uri_prefix[prefix_len - 1] == '/') {
+        prefix_len--;
+    }
+
+    rc = snprintf(uri, sizeof(uri), "%.*s/%s", (int) prefix_len, b->uri_prefix, rel);
+    if (rc < 0 || (size_t) rc >= sizeof(uri)) {
+        goto failed;
+    }
+
+    len = ngx_http_webp_codec_key_material(material, sizeof(material), uri, rc, &b->params);
+    if (len == 0) {
+        goto failed;
+    }
+
+    SHA1((unsigned char *) material, len, digest);
+    ngx_http_webp_codec_key_hex(digest, key);
+    key[NGX_HTTP_WEBP_KEY_LEN] = '\0';
+
+    if (ngx_http_webp_codec_cache_path(dst, sizeof(dst), b->cache_dir, strlen(b->cache_dir), key) == 0) {
+        goto failed;
+    }
+
+    if (!b->force
+        && stat(job->path, &src_st) == 0
+        && stat(dst, &dst_st) == 0
+        && dst_st.st_mtime >= src_st.st_mtime)
+    {
+        pthread_mutex_lock(&b->stats_lock);
+        b->skipped++;
+        pthread_mutex_unlock(&b->stats_lock);
+        return;
+    }
+
+    if (ngx_webp_batch_read(job->path, &data, &size, b->max_image_size) != 0) {
+        goto failed;
+    }
+
+    /*
+     * The encoder writes straight into dst.  As in the module, a variant
+     * that is not smaller than its source is not kept: the source is served.
+     */
+
+    rc = ngx_http_webp_codec_convert_file(ngx_http_webp_codec_format(job->path, strlen(job->path)),
+                                          data, size, &b->params, dst, size, 0, &out);
+    free(data);
+
+    if (rc == NGX_HTTP_WEBP_CODEC_NOT_SMALLER) {
+        unlink(dst);
+
+        pthread_mutex_lock(&b->stats_lock);
+        b->larger++;
+        pthread_mutex_unlock(&b->stats_lock);
+        return;
+    }
+
+    if (rc != NGX_HTTP_WEBP_CODEC_OK) {
+        goto failed;
+    }
+
+    out_size = out.size;
+
+    if (b->verbose) {
+        fprintf(stderr, "%s -> %s\n", uri, dst);
+    }
+
+    pthread_mutex_lock(&b->stats_lock);
+    b->converted++;
+    b->bytes_in += size;
+    b->bytes_out += out_size;
+    pthread_mutex_unlock(&b->stats_lock);
+
+    return;
+
+failed:
+
+    fprintf(stderr, "ngx_webp_batch: failed to convert %s\n", job->path);
+
+    pthread_mutex_lock(&b->stats_lock);
+    b->failed++;
+    pthread_mutex_unlock(&b->stats_lock);
+}
+
+static int
+ngx_webp_batch_pop(ngx_webp_batch_deque_t *dq, size_t *job)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->head < dq->tail) {
+        *job = dq->items[--dq->tail];
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&dq->lock);
+
+    return found;
+}
+
+static int
+ngx_webp_batch_steal(ngx_webp_batch_deque_t *dq, size_t *job)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->head < dq->tail) {
+        *job = dq->items[dq->head++];
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&dq->lock);
+
+    return found;
+}
+
+static void *
+ngx_webp_batch_worker(void *data)
+{
+    ngx_webp_batch_worker_t *w = data;
+    ngx_webp_batch_t *b = w->batch;
+    size_t job;
+    int i, victim;
+
+    for ( ;; ) {
+        if (ngx_webp_batch_pop(&b->deques[w->id], &job)) {
+            ngx_webp_batch_process(b, &b->jobs[job]);
+            continue;
+        }
+
+        /* own deque is drained, steal from the others */
+
+        for (i = 1; i < b->nworkers; i++) {
+            victim = (w->id + i) % b->nworkers;
+
+            if (ngx_webp_batch_steal(&b->deques[victim], &job)) {
+                break;
+            }
+        }
+
+        if (i == b->nworkers) {
+            return NULL;
+        }
+
+        ngx_webp_batch_process(b, &b->jobs[job]);
+    }
+}
+
+static void
+ngx_webp_batch_usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s -r <document_root> -c <cache_dir> [options]\n"
+            "  -r dir    document root the module maps request URIs to\n"
+            "  -c dir    webp_cache_dir of the target location\n"
+            "  -p uri    URI prefix of the document root (default \"/\")\n"
+            "  -q n      WebP quality, must match webp_quality (default 75)\n"
+            "  -m n      encoder method 0-6, the module uses %d (default %d)\n"
+            "  -s bytes  skip sources larger than this (default 10485760)\n"
+            "  -j n      worker threads (default: all online CPUs)\n"
+            "  -f        convert even if the variant is up to date\n"
+            "  -v        print every converted file\n",
+            name, NGX_HTTP_WEBP_DEFAULT_METHOD, NGX_HTTP_WEBP_DEFAULT_METHOD);
+}
+
+int
+main(int argc, char **argv)
+{
+    ngx_webp_batch_worker_t *workers;
+    pthread_t *threads;
+    size_t i;
+    long ncpu;
+    int c, n;
+
+    batch.uri_prefix = "/";
+    batch.params.quality = 75;
+    batch.params.method = NGX_HTTP_WEBP_DEFAULT_METHOD;
+    batch.max_image_size = 10 * 1024 * 1024;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    batch.nworkers = ncpu > 0 ? (int) ncpu : 1;
+
+    while ((c = getopt(argc, argv, "r:c:p:q:m:s:j:fvh")) != -1) {
+        switch (c) {
+        case 'r':
+            batch.root = optarg;
+            break;
+        case 'c':
+            batch.cache_dir = optarg;
+            break;
+        case 'p':
+            batch.uri_prefix = optarg;
+            break;
+        case 'q':
+            batch.params.quality = atoi(optarg);
+            break;
+        case 'm':
+            batch.params.method = atoi(optarg);
+            break;
+        case 's':
+            batch.max_image_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            batch.nworkers = atoi(optarg);
+            break;
+        case 'f':
+            batch.force = 1;
+            break;
+        case 'v':
+            batch.verbose = 1;
+            break;
+        default:
+            ngx_webp_batch_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (batch.root == NULL || batch.cache_dir == NULL
+        || batch.params.quality < 0 || batch.params.quality > 100
+        || batch.params.method < 0 || batch.params.method > 6
+        || batch.nworkers < 1)
+    {
+        ngx_webp_batch_usage(argv[0]);
+        return 2;
+    }
+
+    if (mkdir(batch.cache_dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "ngx_webp_batch: mkdir(\"%s\") failed: %s\n",
+                batch.cache_dir, strerror(errno));
+        return 1;
+    }
+
+    if (nftw(batch.root, ngx_webp_batch_collect, 64, FTW_PHYS) != 0) {
+        fprintf(stderr, "ngx_webp_batch: failed to walk \"%s\"\n", batch.root);
+        return 1;
+    }
+
+    batch.deques = calloc(batch.nworkers, sizeof(ngx_webp_batch_deque_t));
+    workers = calloc(batch.nworkers, sizeof(ngx_webp_batch_worker_t));
+    threads = calloc(batch.nworkers, sizeof(pthread_t));
+
+    if (batch.deques == NULL || workers == NULL || threads == NULL) {
+        fprintf(stderr, "ngx_webp_batch: out of memory\n");
+        return 1;
+    }
+
+    for (n = 0; n < batch.nworkers; n++) {
+        pthread_mutex_init(&batch.deques[n].lock, NULL);
+        batch.deques[n].items = malloc((batch.njobs / batch.nworkers + 1) * sizeof(size_t));
+        if (batch.deques[n].items == NULL) {
+            fprintf(stderr, "ngx_webp_batch: out of memory\n");
+            return 1;
+        }
+    }
+
+    /* round-robin seeding, large and small files end up mixed */
+
+    for (i = 0; i < batch.njobs; i++) {
+        ngx_webp_batch_deque_t *dq = &batch.deques[i % batch.nworkers];
+        dq->items[dq->tail++] = i;
+    }
+
+    pthread_mutex_init(&batch.stats_lock, NULL);
+
+    for (n = 0; n < batch.nworkers; n++) {
+        workers[n].batch = &batch;
+        workers[n].id = n;
+
+        if (pthread_create(&threads[n], NULL, ngx_webp_batch_worker, &workers[n]) != 0) {
+            fprintf(stderr, "ngx_webp_batch: pthread_create() failed\n");
+            return 1;
+        }
+    }
+
+    for (n = 0; n < batch.nworkers; n++) {
+        pthread_join(threads[n], NULL);
+    }
+
+    fprintf(stderr,
+            "ngx_webp_batch: %zu sources, %zu converted, %zu up to date, %zu not smaller, "
+            "%zu failed, %zu bytes in, %zu bytes out, %d threads\n",
+            batch.njobs, batch.converted, batch.skipped, batch.larger, batch.failed,
+            batch.bytes_in, batch.bytes_out, batch.nworkers);
+
+    return batch.failed ? 1 : 0;
+}
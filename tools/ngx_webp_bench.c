@@ -0,0 +1,406 @@
+/*
+ * ngx_webp_bench - micro-benchmark of the module's decode->encode path.
+ *
+ * Runs ngx_http_webp_codec_convert() over a corpus directory for every
+ * combination of source format, quality and encoder method, and prints one
+ * JSON object per line and size class:
+ *
+ *   {"format":"jpeg","size_class":"medium","quality":75,"method":4,
+ *    "images":12,"runs":60,"megapixels_per_sec":..., "p50_ms":...,
+ *    "p99_ms":..., "decode_ms_avg":..., "encode_ms_avg":...,
+ *    "size_ratio":..., "peak_rss_kb":...}
+ *
+ * Each (format, quality, method) case runs in its own child process so
+ * peak_rss_kb is attributable to that case.
+ */
+
+#define _GNU_SOURCE
+
+#include "../ngx_http_webp_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define NGX_WEBP_BENCH_MAX_LIST     16
+#define NGX_WEBP_BENCH_SIZE_CLASSES 3
+
+typedef struct {
+    char *path;
+    ngx_http_webp_format_e format;
+} ngx_webp_bench_file_t;
+
+typedef struct {
+    size_t runs;
+    size_t images;
+    size_t latency_size;
+    uint64_t *latency;
+    uint64_t decode_usec;
+    uint64_t encode_usec;
+    uint64_t pixels;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} ngx_webp_bench_result_t;
+
+static const char *ngx_webp_bench_format_names[] = {
+    "unknown", "jpeg", "png", "avif", "jxl", "gif"
+};
+
+static const char *ngx_webp_bench_size_names[] = {
+    "small", "medium", "large"
+};
+
+static ngx_webp_bench_file_t *files;
+static size_t nfiles, files_size;
+
+static int
+ngx_webp_bench_collect(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    ngx_webp_bench_file_t *f;
+    ngx_http_webp_format_e format;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    format = ngx_http_webp_codec_format(path, strlen(path));
+    if (format == NGX_HTTP_WEBP_FORMAT_UNKNOWN) {
+        return 0;
+    }
+
+    if (nfiles == files_size) {
+        files_size = files_size ? files_size * 2 : 256;
+        f = realloc(files, files_size * sizeof(ngx_webp_bench_file_t));
+        if (f == NULL) {
+            return -1;
+        }
+        files = f;
+    }
+
+    files[nfiles].path = strdup(path);
+    files[nfiles].format = format;
+
+    return files[nfiles++].path == NULL ? -1 : 0;
+}
+
+static int
+ngx_webp_bench_read(const char *path, uint8_t **data, size_t *size)
+{
+    struct stat st;
+    uint8_t *buf;
+    ssize_t n;
+    size_t done;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    buf = malloc(st.st_size ? st.st_size : 1);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    for (done = 0; done < (size_t) st.st_size; done += n) {
+        n = read(fd, buf + done, st.st_size - done);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            free(buf);
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(fd);
+
+    *data = buf;
+    *size = st.st_size;
+
+    return 0;
+}
+
+static int
+ngx_webp_bench_parse_list(const char *s, int *list, int min, int max)
+{
+    char *end;
+    long v;
+    int n = 0;
+
+    while (*s && n < NGX_WEBP_BENCH_MAX_LIST) {
+        v = strtol(s, &end, 10);
+        if (end == s || v < min || v > max) {
+            return -1;
+        }
+
+        list[n++] = (int) v;
+        s = (*end == ',') ? end + 1 : end;
+    }
+
+    return n;
+}
+
+static int
+ngx_webp_bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int
+ngx_webp_bench_size_class(int width, int height)
+{
+    uint64_t pixels = (uint64_t) width * height;
+
+    if (pixels < 500000) {
+        return 0;
+    }
+
+    return pixels < 4000000 ? 1 : 2;
+}
+
+static int
+ngx_webp_bench_record(ngx_webp_bench_result_t *res, uint64_t usec)
+{
+    uint64_t *latency;
+
+    if (res->runs == res->latency_size) {
+        res->latency_size = res->latency_size ? res->latency_size * 2 : 64;
+        latency = realloc(res->latency, res->latency_size * sizeof(uint64_t));
+        if (latency == NULL) {
+            return -1;
+        }
+        res->latency = latency;
+    }
+
+    res->latency[res->runs++] = usec;
+
+    return 0;
+}
+
+static void
+ngx_webp_bench_case(ngx_http_webp_format_e format, int quality, int method, int iterations, int warmup)
+{
+    ngx_webp_bench_result_t results[NGX_WEBP_BENCH_SIZE_CLASSES], *res;
+    ngx_http_webp_params_t params;
+    ngx_http_webp_output_t out;
+    struct rusage ru;
+    uint64_t total;
+    uint8_t *data;
+    size_t i, size;
+    int k, c, w, h;
+    ngx_http_webp_image_t img;
+
+    memset(results, 0, sizeof(results));
+    memset(&params, 0, sizeof(params));
+
+    params.quality = quality;
+    params.method = method;
+
+    for (i = 0; i < nfiles; i++) {
+        if (files[i].format != format) {
+            continue;
+        }
+
+        if (ngx_webp_bench_read(files[i].path, &data, &size) != 0) {
+            fprintf(stderr, "ngx_webp_bench: cannot read %s\n", files[i].path);
+            continue;
+        }
+
+        if (ngx_http_webp_codec_decode(format, data, size, &img) != NGX_HTTP_WEBP_CODEC_OK) {
+            fprintf(stderr, "ngx_webp_bench: cannot decode %s\n", files[i].path);
+            free(data);
+            continue;
+        }
+
+        w = img.width;
+        h = img.height;
+        ngx_http_webp_codec_free_image(&img);
+
+        res = &results[ngx_webp_bench_size_class(w, h)];
+        res->images++;
+
+        for (k = -warmup; k < iterations; k++) {
+            if (ngx_http_webp_codec_convert(format, data, size, &params, &out) != NGX_HTTP_WEBP_CODEC_OK) {
+                fprintf(stderr, "ngx_webp_bench: cannot convert %s\n", files[i].path);
+                break;
+            }
+
+            if (k >= 0) {
+                if (ngx_webp_bench_record(res, out.decode_usec + out.encode_usec) != 0) {
+                    exit(1);
+                }
+
+                res->decode_usec += out.decode_usec;
+                res->encode_usec += out.encode_usec;
+                res->pixels += (uint64_t) w * h;
+                res->bytes_in += size;
+                res->bytes_out += out.size;
+            }
+
+            ngx_http_webp_codec_free_output(&out);
+        }
+
+        free(data);
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    for (c = 0; c < NGX_WEBP_BENCH_SIZE_CLASSES; c++) {
+        res = &results[c];
+
+        if (res->runs == 0) {
+            continue;
+        }
+
+        qsort(res->latency, res->runs, sizeof(uint64_t), ngx_webp_bench_cmp);
+
+        total = res->decode_usec + res->encode_usec;
+
+        printf("{\"format\":\"%s\",\"size_class\":\"%s\",\"quality\":%d,\"method\":%d,"
+               "\"images\":%zu,\"runs\":%zu,\"megapixels_per_sec\":%.3f,"
+               "\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+               "\"decode_ms_avg\":%.3f,\"encode_ms_avg\":%.3f,"
+               "\"size_ratio\":%.4f,\"peak_rss_kb\":%ld}\n",
+               ngx_webp_bench_format_names[format], ngx_webp_bench_size_names[c],
+               quality, method, res->images, res->runs,
+               total ? (double) res->pixels / total : 0.0,
+               res->latency[(res->runs - 1) * 50 / 100] / 1000.0,
+               res->latency[(res->runs - 1) * 99 / 100] / 1000.0,
+               res->decode_usec / 1000.0 / res->runs,
+               res->encode_usec / 1000.0 / res->runs,
+               res->bytes_in ? (double) res->bytes_out / res->bytes_in : 0.0,
+               ru.ru_maxrss);
+
+        free(res->latency);
+    }
+
+    fflush(stdout);
+}
+
+static void
+ngx_webp_bench_usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s -d <corpus_dir> [options]\n"
+            "  -d dir    corpus directory, searched recursively\n"
+            "  -q list   comma separated qualities (default 50,75,90)\n"
+            "  -m list   comma separated encoder methods (default 0,4,6)\n"
+            "  -f name   only run one source format (jpeg, png, avif, jxl, gif)\n"
+            "  -n n      measured runs per image (default 5)\n"
+            "  -w n      warm-up runs per image (default 1)\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    int qualities[NGX_WEBP_BENCH_MAX_LIST] = { 50, 75, 90 };
+    int methods[NGX_WEBP_BENCH_MAX_LIST] = { 0, 4, 6 };
+    int nqualities = 3, nmethods = 3, iterations = 5, warmup = 1;
+    int c, fmt, q, m, only = NGX_HTTP_WEBP_FORMAT_UNKNOWN, status;
+    const char *dir = NULL;
+    pid_t pid;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "d:q:m:f:n:w:h")) != -1) {
+        switch (c) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'q':
+            nqualities = ngx_webp_bench_parse_list(optarg, qualities, 0, 100);
+            break;
+        case 'm':
+            nmethods = ngx_webp_bench_parse_list(optarg, methods, 0, 6);
+            break;
+        case 'f':
+            for (fmt = NGX_HTTP_WEBP_FORMAT_JPEG; fmt <= NGX_HTTP_WEBP_FORMAT_GIF; fmt++) {
+                if (strcmp(optarg, ngx_webp_bench_format_names[fmt]) == 0) {
+                    only = fmt;
+                }
+            }
+            if (only == NGX_HTTP_WEBP_FORMAT_UNKNOWN) {
+                ngx_webp_bench_usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        default:
+            ngx_webp_bench_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (dir == NULL || nqualities <= 0 || nmethods <= 0 || iterations < 1 || warmup < 0) {
+        ngx_webp_bench_usage(argv[0]);
+        return 2;
+    }
+
+    if (nftw(dir, ngx_webp_bench_collect, 64, FTW_PHYS) != 0) {
+        fprintf(stderr, "ngx_webp_bench: failed to walk \"%s\"\n", dir);
+        return 1;
+    }
+
+    for (fmt = NGX_HTTP_WEBP_FORMAT_JPEG; fmt <= NGX_HTTP_WEBP_FORMAT_GIF; fmt++) {
+        if (only != NGX_HTTP_WEBP_FORMAT_UNKNOWN && fmt != only) {
+            continue;
+        }
+
+        for (i = 0; i < nfiles; i++) {
+            if (files[i].format == (ngx_http_webp_format_e) fmt) {
+                break;
+            }
+        }
+
+        if (i == nfiles) {
+            continue;
+        }
+
+        for (q = 0; q < nqualities; q++) {
+            for (m = 0; m < nmethods; m++) {
+                pid = fork();
+
+                if (pid == -1) {
+                    fprintf(stderr, "ngx_webp_bench: fork() failed: %s\n", strerror(errno));
+                    return 1;
+                }
+
+                if (pid == 0) {
+                    ngx_webp_bench_case(fmt, qualities[q], methods[m], iterations, warmup);
+                    _exit(0);
+                }
+
+                if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    fprintf(stderr, "ngx_webp_bench: case %s q=%d m=%d failed\n",
+                            ngx_webp_bench_format_names[fmt], qualities[q], methods[m]);
+                }
+            }
+        }
+    }
+
+    return 0;
+}